@@ -0,0 +1,551 @@
+/**************************************************************************************************
+ * Stacky core benchmarks on synthetic stacks.
+ *
+ * Builds in-memory stacks of 10 / 1k / 100k entries at several nesting depths and times the
+ * platform-neutral parts of a stack open: scan, staleness check, cache serialize, cache decode and
+ * menu tree build, plus the allocations of a menu session. Icon storage is measured on synthetic icons in every cached size: encoded size,
+ * decode throughput, and reading plus decoding the encoded icons against reading the raw pixels, both
+ * from a file with a cold page cache where the OS allows evicting it. Results are written as JSON so
+ * runs can be compared between releases.
+ *
+ *   stacky_bench [--repeat N] [--out file.json]
+ **************************************************************************************************/
+#include "stacky_core.h"
+#include "resource.h" // for version info
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <new>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/**************************************************************************************************
+ * Heap accounting, for the peak memory of each case
+ **************************************************************************************************/
+static std::atomic<size_t> heap_now(0), heap_peak(0), heap_allocs(0);
+static const size_t HEAP_HEADER = 16; // keeps the returned pointer max_align_t aligned
+
+void* operator new(size_t size) {
+	Byte* p = (Byte*)malloc(size + HEAP_HEADER);
+	if (!p) throw std::bad_alloc();
+	*(size_t*)p = size;
+	heap_allocs++;
+	size_t now = heap_now += size;
+	for (size_t peak = heap_peak; now > peak && !heap_peak.compare_exchange_weak(peak, now); ) {}
+	return p + HEAP_HEADER;
+}
+// Not inlined: callers would see free() on the pointer operator new returned, 16 bytes off its block
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr) noexcept {
+	if (!ptr) return;
+	Byte* p = (Byte*)ptr - HEAP_HEADER;
+	heap_now -= *(size_t*)p;
+	free(p);
+}
+void operator delete(void* ptr, size_t) noexcept {
+	operator delete(ptr);
+}
+
+
+/**************************************************************************************************
+ * Synthetic stack
+ **************************************************************************************************/
+struct SyntheticFileSystem : FileSystem {
+	enum { SUBFOLDERS = 4 };
+
+	std::map<String, std::vector<DirEntry>> dirs;
+
+	// `count` entries below `dir`, nested up to `depth` folder levels
+	SyntheticFileSystem(const String& dir, size_t count, int depth) : next_time(132000000000000000ULL) {
+		fill(dir, count, depth);
+	}
+
+	bool list(const String& dir, std::vector<DirEntry>& entries) override {
+		auto it = dirs.find(dir);
+		if (it == dirs.end()) {
+			return false;
+		}
+		entries.insert(entries.end(), it->second.begin(), it->second.end());
+		return true;
+	}
+
+private:
+	U64 next_time;
+
+	// Part of the entries stay in this folder, the rest is split over SUBFOLDERS .submenu folders
+	void fill(const String& dir, size_t count, int depth) {
+		std::vector<DirEntry>& list = dirs[dir];
+		size_t folders = depth > 1 ? std::min((size_t)SUBFOLDERS, count / 2) : 0;
+		size_t below = folders ? (count - folders) / 2 : 0;
+		size_t files = count - folders - below;
+
+		static const Char* extensions[] = { L".lnk", L".lnk", L".lnk", L".url", L".exe", L".bat" };
+		for (size_t i = 0; i < files; i++) {
+			String name = (i % 25 == 24) ? L"-" + std::to_wstring(i) + L".separator" : L"Application " + std::to_wstring(i) + extensions[i % 6];
+			list.push_back(DirEntry{ name, 1000 + i * 7, next_time++, false, false });
+		}
+		// Entries the scan has to look at and skip
+		list.push_back(DirEntry{ CACHE_FILE_NAME, 4096, next_time++, false, true });
+		if (depth > 1) {
+			list.push_back(DirEntry{ DESKTOP_INI, 120, next_time++, false, true });
+		}
+		for (size_t f = 0; f < folders; f++) {
+			String name = L"Folder " + std::to_wstring(f) + SUBMENU_SUFFIX;
+			list.push_back(DirEntry{ name, 0, next_time++, true, false });
+			fill(dir + name + DIR_SEP, below / folders + (f < below % folders ? 1 : 0), depth - 1);
+		}
+	}
+};
+
+
+/**************************************************************************************************
+ * Measurements
+ **************************************************************************************************/
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+	size_t  entries;
+	int     depth;
+	size_t  scanned;
+	size_t  groups;
+	size_t  cache_bytes;
+	double  scan_ms;
+	double  stale_check_ms;
+	double  serialize_ms;
+	double  deserialize_ms;
+	double  menu_tree_ms;
+	double  search_ms;
+	double  menu_session_ms;
+	size_t  menu_session_allocs_cold;   // first open, entries and labels in a new arena
+	size_t  menu_session_allocs_warm;   // later opens, in the reset arena of a resident host
+	size_t  menu_entry_allocs;          // per open, the previous heap MenuEntry with its two strings
+	size_t  peak_heap_bytes;
+	double  item_bytes;         // item table heap per item once every group is decoded, strings aside
+	double  rebuild_item_bytes; // same for the rebuilt table, which also keeps the scan stamps
+};
+
+// Set by a failed correctness check: the results are still written, but the run exits with 1
+static bool check_failed = false;
+
+// Median of `repeat` runs of `run`, in milliseconds
+template <typename Run>
+static double time_ms(int repeat, Run run) {
+	std::vector<double> times;
+	for (int r = 0; r < repeat; r++) {
+		Clock::time_point start = Clock::now();
+		run();
+		times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// What a rebuild produces for the scanned stack, with one shared blank icon. Shortcuts get a target as
+// resolve_target() would give them.
+static void serialize_stack(CacheCore& cache, Buffer& buffer) {
+	cache.add_scanned_items();
+	cache.slots.assign(cache.item_count(), 0);
+	for (size_t i = 1; i < cache.item_count(); i++) {
+		String name(cache.name(i));
+		if (CoreUtil::ends_with(name, SUBMENU_SUFFIX)) {
+			cache.flags[i] = CacheCore::FLAG_SUBMENU;
+		}
+		else if (CoreUtil::ends_with(name, L".lnk")) {
+			cache.set_target(i, L"C:\\Program Files\\Application\\app.exe", L"", L"C:\\Program Files\\Application", 1);  // SW_NORMAL
+		}
+		else if (CoreUtil::ends_with(name, L".url")) {
+			cache.set_target(i, L"https://example.com/", L"", L"", 1);  // SW_NORMAL
+		}
+	}
+	cache.build_index();
+	std::vector<Byte> blank(CacheCore::icon_set_bytes(), 0);
+	cache.serialize(buffer, 1, [&](size_t s, U32) {
+		return blank.data() + CacheCore::icon_set_offset(s);
+	});
+}
+
+static Result run_case(size_t entries, int depth, int repeat) {
+	const String stack_path = L"C:\\Stacks\\Bench";
+	Result r = {};
+	r.entries = entries;
+	r.depth = depth;
+	SyntheticFileSystem fs(CacheCore(stack_path).base_dir, entries, depth);
+	heap_peak = heap_now.load();
+	size_t heap_base = heap_now;
+
+	// Scan: one enumeration pass over the whole stack
+	CacheCore cache(stack_path);
+	r.scan_ms = time_ms(repeat, [&]() { cache.scan(fs); });
+	r.scanned = cache.scanned_count();
+
+	// Serialize: index build and the full cache file
+	Buffer file;
+	r.serialize_ms = time_ms(repeat, [&]() {
+		file.free();
+		serialize_stack(cache, file);
+	});
+	r.cache_bytes = file.size;
+	r.groups = cache.groups.size();
+	ByteView view(file.data, file.size);
+
+	// Staleness check: what a warm start does before showing the menu
+	r.stale_check_ms = time_ms(repeat, [&]() {
+		CacheCore warm(stack_path);
+		CacheCore::Header header;
+		if (!warm.scan(fs) || !warm.read_index(view, header) || warm.is_outdated()) {
+			fprintf(stderr, "stale check failed: %zu entries, depth %d\n", entries, depth);
+			check_failed = true;
+		}
+	});
+
+	// Deserialize: index and every group's records
+	CacheCore loaded(stack_path);
+	r.deserialize_ms = time_ms(repeat, [&]() {
+		CacheCore::Header header;
+		size_t bytes_read = 0;
+		bool ok = loaded.read_index(view, header);
+		for (U32 g = 0; ok && g < loaded.groups.size(); g++) {
+			ok = loaded.decode_group(view, g, bytes_read);
+		}
+		if (!ok || loaded.targets.size() != cache.targets.size()) {
+			fprintf(stderr, "decode failed: %zu entries, depth %d\n", entries, depth);
+			check_failed = true;
+		}
+	});
+	r.item_bytes = (double)loaded.item_table_bytes() / loaded.item_count();
+	r.rebuild_item_bytes = (double)cache.item_table_bytes() / cache.item_count();
+
+	// Menu tree: labels and separators of every level
+	r.menu_tree_ms = time_ms(repeat, [&]() {
+		std::vector<MenuNode> nodes;
+		for (U32 g = 0; g < loaded.groups.size(); g++) {
+			nodes.clear();
+			MenuTree::build_level(loaded, g, nodes);
+		}
+	});
+
+	// Search: first keystroke of type-to-filter, index load and a query that scans the whole text
+	r.search_ms = time_ms(repeat, [&]() {
+		SearchIndex search;
+		std::vector<U32> found;
+		if (!search.load(loaded)) {
+			fprintf(stderr, "search index invalid: %zu entries, depth %d\n", entries, depth);
+			check_failed = true;
+		}
+		search.find(L"Application 9x", 100, found);
+	});
+
+	// Menu session: what the app keeps for every level once all of them were opened, in an arena that
+	// is reset when the menu closes, against allocating each entry on the heap. A one-shot stacky opens
+	// one menu, so the cold count of a new arena is the one it pays.
+	struct SessionEntry {
+		U32                     item;
+		StringView              text;
+		bool                    is_submenu;
+		U32                     group;
+		int                     text_width;
+	};
+	// The MenuEntry the arena replaced: the label and, for a submenu, its folder's path prefix
+	struct HeapEntry {
+		U32                     item;
+		String                  text;
+		bool                    is_submenu;
+		bool                    populated;
+		String                  submenu_prefix;
+		bool                    is_path;
+	};
+	std::vector<MenuNode> nodes;
+	nodes.reserve(loaded.item_count());
+	std::vector<HeapEntry*> heap_entries;
+	heap_entries.reserve(loaded.item_count());
+	auto open_all = [&](Arena* session) {
+		for (U32 g = 0; g < loaded.groups.size(); g++) {
+			nodes.clear();
+			MenuTree::build_level(loaded, g, nodes);
+			for (const MenuNode& node : nodes) {
+				if (node.is_separator) continue;
+				if (session) {
+					SessionEntry* e = session->make<SessionEntry>();
+					*e = SessionEntry{ node.item, session->intern(node.text), node.is_submenu, node.group, 0 };
+				}
+				else {
+					String prefix = node.is_submenu ? String(loaded.name(node.item)) + DIR_SEP : String();
+					heap_entries.push_back(new HeapEntry{ node.item, String(node.text), node.is_submenu, false, prefix, false });
+				}
+			}
+		}
+	};
+	size_t allocs = heap_allocs;
+	{
+		Arena cold;
+		open_all(&cold);
+		r.menu_session_allocs_cold = heap_allocs - allocs;
+		cold.reset();
+		allocs = heap_allocs;
+		open_all(&cold);
+		r.menu_session_allocs_warm = heap_allocs - allocs;
+	}
+	allocs = heap_allocs;
+	open_all(nullptr);
+	r.menu_entry_allocs = heap_allocs - allocs;
+	for (HeapEntry* e : heap_entries) delete e;
+
+	Arena session;
+	r.menu_session_ms = time_ms(repeat, [&]() {
+		session.reset();
+		open_all(&session);
+	});
+
+	r.peak_heap_bytes = heap_peak - heap_base;
+	file.free();
+	return r;
+}
+
+/**************************************************************************************************
+ * Icon storage
+ **************************************************************************************************/
+struct IconResult {
+	size_t  icons;
+	size_t  raw_bytes;
+	size_t  encoded_bytes;
+	double  encode_ms;
+	double  decode_ms;
+	double  raw_read_ms;        // the raw pixels from a file
+	double  encoded_read_ms;    // the encoded icons from a file, decoded
+	bool    cold_reads;         // both files were evicted from the page cache before every read
+};
+
+static const char* RAW_ICONS_FILE = "stacky_bench_icons.raw";
+static const char* ENCODED_ICONS_FILE = "stacky_bench_icons.enc";
+
+static bool write_file(const char* path, const Byte* data, size_t size) {
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	bool written = fwrite(data, 1, size, f) == size;
+	return fclose(f) == 0 && written;
+}
+
+static bool read_file(const char* path, std::vector<Byte>& data) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return false;
+	bool read = fread(data.data(), 1, data.size(), f) == data.size();
+	fclose(f);
+	return read;
+}
+
+// Evicts a file from the page cache so the next read comes from the disk. True when none of its pages
+// stayed resident; always false on Windows, and on file systems that keep files in memory (tmpfs).
+static bool drop_page_cache(const char* path, size_t size) {
+#if defined(_WIN32) || !defined(POSIX_FADV_DONTNEED)
+	return false;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	bool cold = fdatasync(fd) == 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+	void* view = cold ? mmap(0, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (view != MAP_FAILED) {
+		long page = sysconf(_SC_PAGESIZE);
+		std::vector<unsigned char> resident((size + page - 1) / page);
+		cold = mincore(view, size, resident.data()) == 0;
+		for (unsigned char r : resident) cold = cold && !(r & 1);
+		munmap(view, size);
+	}
+	close(fd);
+	return cold;
+#endif
+}
+
+// Median of `repeat` reads, each after `path` was dropped from the page cache; `cold` is cleared when it stayed
+template <typename Run>
+static double time_cold_ms(int repeat, const char* path, size_t size, bool& cold, Run run) {
+	std::vector<double> times;
+	for (int r = 0; r < repeat; r++) {
+		cold = drop_page_cache(path, size) && cold;
+		Clock::time_point start = Clock::now();
+		run();
+		times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// A shaded disc with an outline and some detail, premultiplied like the extracted icons
+static void synthetic_icon(U32 size, U32 seed, Byte* pixels) {
+	float c = size / 2.0f, r = size * 0.42f;
+	for (U32 y = 0; y < size; y++) {
+		for (U32 x = 0; x < size; x++) {
+			Byte* p = pixels + (y * size + x) * 4;
+			float dx = x + 0.5f - c, dy = y + 0.5f - c;
+			float d = sqrtf(dx * dx + dy * dy);
+			float alpha = std::min(1.0f, std::max(0.0f, r - d + 0.5f));
+			float shade = 0.55f + 0.45f * (1.0f - (float)y / size);
+			if (d > r - 1.5f) shade *= 0.6f;    // outline
+			if (((x * 7 + y * 3 + seed) % 11) == 0 && d < r * 0.6f) shade *= 0.8f;
+			Byte rgb[3] = { (Byte)(seed * 37), (Byte)(seed * 91 + 60), (Byte)(seed * 53 + 120) };
+			for (int ch = 0; ch < 3; ch++) {
+				p[ch] = (Byte)(rgb[ch] * shade * alpha);
+			}
+			p[3] = (Byte)(255 * alpha + 0.5f);
+		}
+	}
+}
+
+static IconResult run_icons(U32 icon_count, int repeat) {
+	IconResult r = {};
+	r.icons = icon_count;
+	std::vector<Byte> sets(icon_count * CacheCore::icon_set_bytes());
+	for (U32 i = 0; i < icon_count; i++) {
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			synthetic_icon(ICON_SIZES[s], i, sets.data() + i * CacheCore::icon_set_bytes() + CacheCore::icon_set_offset(s));
+		}
+	}
+	r.raw_bytes = sets.size();
+
+	// Encode: what a rebuild adds for the icon tables
+	std::vector<Byte> encoded(IconCodec::max_size(sets.size() / 4));
+	std::vector<size_t> offsets;
+	r.encode_ms = time_ms(repeat, [&]() {
+		offsets.clear();
+		size_t pos = 0;
+		for (U32 i = 0; i < icon_count; i++) {
+			for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+				offsets.push_back(pos);
+				pos += IconCodec::encode(sets.data() + i * CacheCore::icon_set_bytes() + CacheCore::icon_set_offset(s), ICON_SIZES[s] * ICON_SIZES[s], encoded.data() + pos);
+			}
+		}
+		offsets.push_back(pos);
+	});
+	r.encoded_bytes = offsets.back();
+
+	// Every icon has to come back exactly: packed, and into a cell of a wider bitmap like the app's atlas
+	std::vector<Byte> out(CacheCore::icon_bytes(ICON_SIZES[ICON_SIZE_COUNT - 1]));
+	std::vector<Byte> grid(2 * out.size());
+	for (size_t i = 0, k = 0; i < icon_count; i++) {
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++, k++) {
+			const Byte* data = encoded.data() + offsets[k];
+			size_t data_size = offsets[k + 1] - offsets[k];
+			const Byte* icon = sets.data() + i * CacheCore::icon_set_bytes() + CacheCore::icon_set_offset(s);
+			size_t size = ICON_SIZES[s], row = size * 4;
+			bool ok = IconCodec::decode(data, data_size, out.data(), size * size) && !memcmp(out.data(), icon, size * row);
+			ok = ok && IconCodec::decode(data, data_size, grid.data() + row, size, size, 2 * row);
+			for (size_t y = 0; ok && y < size; y++) {
+				ok = !memcmp(grid.data() + row + y * 2 * row, icon + y * row, row);
+			}
+			if (!ok) {
+				fprintf(stderr, "icon %zu at %zupx does not round-trip\n", i, size);
+				check_failed = true;
+			}
+		}
+	}
+
+	// Decoding alone, from memory
+	auto decode_all = [&]() {
+		size_t k = 0;
+		for (U32 i = 0; i < icon_count; i++) {
+			for (size_t s = 0; s < ICON_SIZE_COUNT; s++, k++) {
+				IconCodec::decode(encoded.data() + offsets[k], offsets[k + 1] - offsets[k], out.data(), ICON_SIZES[s] * ICON_SIZES[s]);
+			}
+		}
+	};
+	r.decode_ms = time_ms(repeat, decode_all);
+
+	// What a stack open pays: reading the encoded icons and decoding them against reading the raw pixels
+	std::vector<Byte> raw_in(r.raw_bytes), encoded_in(r.encoded_bytes);
+	if (!write_file(RAW_ICONS_FILE, sets.data(), r.raw_bytes) || !write_file(ENCODED_ICONS_FILE, encoded.data(), r.encoded_bytes)) {
+		fprintf(stderr, "cannot write the icon files to the current folder\n");
+	}
+	r.cold_reads = true;
+	r.raw_read_ms = time_cold_ms(repeat, RAW_ICONS_FILE, r.raw_bytes, r.cold_reads, [&]() {
+		read_file(RAW_ICONS_FILE, raw_in);
+	});
+	r.encoded_read_ms = time_cold_ms(repeat, ENCODED_ICONS_FILE, r.encoded_bytes, r.cold_reads, [&]() {
+		if (read_file(ENCODED_ICONS_FILE, encoded_in)) {
+			memcpy(encoded.data(), encoded_in.data(), r.encoded_bytes);
+			decode_all();
+		}
+	});
+	remove(RAW_ICONS_FILE);
+	remove(ENCODED_ICONS_FILE);
+	return r;
+}
+
+static size_t max_rss_kb() {
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t)usage.ru_maxrss;
+#endif
+}
+
+
+/**************************************************************************************************
+ * Entry point
+ **************************************************************************************************/
+int main(int argc, char** argv) {
+	int repeat = 5;
+	const char* out_path = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+			repeat = std::max(1, atoi(argv[++i]));
+		}
+		else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: stacky_bench [--repeat N] [--out file.json]\n");
+			return 1;
+		}
+	}
+
+	static const size_t sizes[] = { 10, 1000, 100000 };
+	static const int depths[] = { 1, 3, 6 };
+	std::vector<Result> results;
+	for (size_t entries : sizes) {
+		for (int depth : depths) {
+			results.push_back(run_case(entries, depth, repeat));
+		}
+	}
+
+	IconResult icons = run_icons(256, repeat);
+
+	FILE* out = out_path ? fopen(out_path, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "cannot write %s\n", out_path);
+		return 1;
+	}
+	fprintf(out, "{\n\"benchmark\":\"stacky_core\",\"version\":\"%ls\",\"cache_version\":%u,\"repeat\":%d,\"unit\":\"ms\",\n\"cases\":[",
+		STACKY_VERSION_STR, CACHE_VERSION, repeat);
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		fprintf(out, "%s\n{\"entries\":%zu,\"depth\":%d,\"scanned\":%zu,\"groups\":%zu,\"cache_bytes\":%zu,"
+			"\"scan\":%.4f,\"stale_check\":%.4f,\"serialize\":%.4f,\"deserialize\":%.4f,\"menu_tree\":%.4f,\"search\":%.4f,\"menu_session\":%.4f,"
+			"\"menu_session_allocs_cold\":%zu,\"menu_session_allocs_warm\":%zu,\"menu_entry_allocs\":%zu,\"peak_heap_bytes\":%zu,\"item_bytes\":%.1f,\"rebuild_item_bytes\":%.1f}",
+			i ? "," : "", r.entries, r.depth, r.scanned, r.groups, r.cache_bytes,
+			r.scan_ms, r.stale_check_ms, r.serialize_ms, r.deserialize_ms, r.menu_tree_ms, r.search_ms, r.menu_session_ms,
+			r.menu_session_allocs_cold, r.menu_session_allocs_warm, r.menu_entry_allocs, r.peak_heap_bytes, r.item_bytes, r.rebuild_item_bytes);
+	}
+	// Throughput in MB of decoded pixels per second; cold_reads is false when the files could not be evicted
+	fprintf(out, "\n],\n\"icons\":{\"icons\":%zu,\"sizes\":%zu,\"raw_bytes\":%zu,\"encoded_bytes\":%zu,\"ratio\":%.3f,"
+		"\"encode\":%.4f,\"decode\":%.4f,\"decode_mb_s\":%.1f,\"raw_read\":%.4f,\"encoded_read_decode\":%.4f,\"cold_reads\":%s},",
+		icons.icons, ICON_SIZE_COUNT, icons.raw_bytes, icons.encoded_bytes, (double)icons.encoded_bytes / icons.raw_bytes,
+		icons.encode_ms, icons.decode_ms, icons.raw_bytes / 1000.0 / icons.decode_ms, icons.raw_read_ms, icons.encoded_read_ms,
+		icons.cold_reads ? "true" : "false");
+	fprintf(out, "\n\"max_rss_kb\":%zu\n}\n", max_rss_kb());
+	if (out != stdout) fclose(out);
+	return check_failed ? 1 : 0;
+}
@@ -9,8 +9,13 @@
 #include <wincodec.h>
 #include <Tlhelp32.h>
 #include <CommCtrl.h>
+#include <commoncontrols.h>
 #include <strsafe.h>
+#include <Psapi.h>
+#include <ShellScalingApi.h>
 #pragma comment(lib, "Comctl32.lib")
+#pragma comment(lib, "Psapi.lib")
+#pragma comment(lib, "Shcore.lib")
 
  /**************************************************************************************************
   * Standard libs
@@ -18,9 +23,16 @@
 #include <cstdio>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 #include "resource.h" // for version info
+#include "stacky_core.h"
 
 #include <wingdi.h>
 #pragma comment(lib, "Msimg32.lib")
@@ -29,27 +41,31 @@
   /**************************************************************************************************
    * Simple types and constants
    **************************************************************************************************/
-typedef wchar_t                 Char;
-typedef unsigned char           Byte;
-typedef __time64_t              Time;
-typedef std::wstring            String;
-typedef std::vector<String>     StringList;
-
-const String CACHE_FILE_NAME = L"!stacky.cache";
+// Core types and cache constants are in stacky_core.h
 const String STACKY_EXEC_NAME = L"stacky.exe";
 const Char* STACKY_WINDOW_NAME = L"stacky";
-const Char* DIR_SEP = L"\\";
-const String SUBMENU_SUFFIX = L".submenu";
-const String DESKTOP_INI = L"desktop.ini";
-const DWORD CACHE_VERSION = 9; // Increment this when cache format changes
+const Char* STACKY_HOST_NAME = L"stacky host";    // title of the resident host's window
 
 enum {
 	WM_BASE = WM_USER + 100,
 	WM_OPEN_TARGET_FOLDER = WM_BASE + 1,
 	WM_MENU_ITEM = WM_BASE + 2,
 	WM_OPEN_LOCATION = WM_BASE + 3,
-
-	APP_EXIT_DELAY = 3 * 1000,
+	WM_CACHE_REFRESHED = WM_BASE + 4,  // posted by the background refresh when it is done
+	WM_SHOW_STACK = WM_BASE + 5,       // resident host: show the forwarded stack
+	WM_STACK_CHANGED = WM_BASE + 6,    // resident host: a watched stack folder changed
+	WM_LAUNCHED = WM_BASE + 7,         // a launch worker is done
+	WM_LIST_SELECT = WM_BASE + 8,      // sent by a ListPopup: wParam is the highlighted item, 0 for none
+
+	COPYDATA_SHOW_STACK = 1,           // WM_COPYDATA payload: a stacky.exe command line
+	HOST_TIMEOUT = 1000,               // how long a launcher waits for the resident host
+	REFRESH_DELAY = 250,               // resident host: quiet time after a folder change before refreshing
+	MAX_MENU_COMMANDS = 0x10000 - WM_MENU_ITEM,  // command IDs of a menu stay 16-bit, see App::commands
+	LIST_THRESHOLD = 400,              // folders with more items open in a ListPopup instead of a native submenu
+	MAX_SEARCH_RESULTS = 100,          // type-to-filter: matches listed at once
+	MAX_QUERY_LENGTH = 64,
+	PREFETCH_TIMER = 1,                // timer ID; the other timers of the window are Stack pointers
+	PREFETCH_DWELL = 150,              // how long an item has to stay highlighted before it is prefetched
 
 	ERR_PATH_MISSING = 401,
 	ERR_PATH_INVALID = 402,
@@ -71,42 +87,20 @@ struct ComInit {
  * The meat
  **************************************************************************************************/
 
-struct Util {
-
-	static String rtrim(const String& target, const String& trim) {
-		size_t cutoff_pos = target.size() - trim.size();
-		return target.rfind(trim) == cutoff_pos ? target.substr(0, cutoff_pos) : target;
-	}
-	static String ltrim(const String& target, const String& trim) {
-		size_t cutoff_pos = trim.size();
-		return target.find(trim) != String::npos ? target.substr(cutoff_pos) : target;
-	}
-	static String trim(const String& target, const String& trim) {
-		return rtrim(ltrim(target, trim), trim);
-	}
-	static String quote(const String& target) {
-		return L"\"" + target + L"\"";
-	}
-	static bool ends_with(const String& target, const String& ending)
-	{
-		if (target.length() >= ending.length())
-		{
-			return (0 == target.compare(target.length() - ending.length(), ending.length(), ending));
-		}
-		else
-		{
-			return false;
-		}
-	}
+struct Util : CoreUtil {
 
 	static void kill_other_stackies() {
 		PROCESSENTRY32 entry = { 0 };
 		entry.dwSize = sizeof(PROCESSENTRY32);
 		BOOL found = false;
+		// The resident host is not a leftover, it serves every stack
+		DWORD host_pid = 0;
+		HWND host = ::FindWindow(STACKY_WINDOW_NAME, STACKY_HOST_NAME);
+		if (host) ::GetWindowThreadProcessId(host, &host_pid);
 		HANDLE snapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPALL, 0);
 		do {
 			found = ::Process32Next(snapshot, &entry);
-			if (entry.th32ProcessID != ::GetCurrentProcessId() && entry.szExeFile == STACKY_EXEC_NAME) {
+			if (entry.th32ProcessID != ::GetCurrentProcessId() && entry.th32ProcessID != host_pid && entry.szExeFile == STACKY_EXEC_NAME) {
 				HANDLE hOtherStacky = ::OpenProcess(PROCESS_ALL_ACCESS, FALSE, entry.th32ProcessID);
 				if (hOtherStacky) {
 					::TerminateProcess(hOtherStacky, 0);
@@ -119,9 +113,16 @@ struct Util {
 		} while (found);
 		::CloseHandle(snapshot);
 	}
-	static Time get_modified(const String& file_path) {
-		struct _stat buf;
-		return _wstat(file_path.c_str(), &buf) ? 0 : buf.st_mtime;
+	static ULONGLONG file_time(const FILETIME& ft) {
+		return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	}
+	// DPI of the monitor showing `pt`, which is where a menu opened at `pt` is drawn
+	static UINT monitor_dpi(POINT pt) {
+		UINT dpi_x = 0, dpi_y = 0;
+		if (FAILED(::GetDpiForMonitor(::MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST), MDT_EFFECTIVE_DPI, &dpi_x, &dpi_y))) {
+			return ::GetDpiForSystem();
+		}
+		return dpi_x;
 	}
 	static int parse_cmd_line(const String& cmd_line, String& stack_path, String& opts) {
 		stack_path = cmd_line;
@@ -270,191 +271,299 @@ struct Util {
 	}
 };
 
-struct Buffer {
-	size_t  capacity, size;
-	Byte* data;
+/**************************************************************************************************
+ * Tracing: with --trace, phase timings, counters and resource usage are written to %TEMP%\stacky-trace-<pid>.json.
+ * When it is off every probe is a single branch; build with STACKY_TRACE=0 to drop them entirely.
+ **************************************************************************************************/
+#ifndef STACKY_TRACE
+#define STACKY_TRACE 1
+#endif
 
-	Buffer() : capacity(0), size(0), data(0) {}
-	~Buffer() {}
+struct Trace {
+	enum Counter {
+		ITEMS_SCANNED,
+		ICONS_EXTRACTED,
+		ICONS_REUSED,
+		GROUPS_DECODED,
+		CACHE_BYTES_READ,
+		CACHE_BYTES_WRITTEN,
+		PREFETCH_BYTES,
+		COUNTER_COUNT
+	};
 
-	void free() {
-		if (data) {
-			delete[] data;
-			data = 0;
-		}
-		capacity = size = 0;
+	static bool on() {
+		return STACKY_TRACE && enabled;
 	}
-	bool load(const String& str, bool append_null) {
-		load(str.c_str(), str.size() * sizeof(Char));
-		if (append_null) {
-			Char str_end[1] = { 0 };
-			load(str_end, sizeof(Char));
-		}
-		return true;
+	static void start() {
+		Char temp[MAX_PATH] = { 0 };
+		::GetTempPath(MAX_PATH, temp);
+		path = String(temp) + L"stacky-trace-" + std::to_wstring(::GetCurrentProcessId()) + L".json";
+
+		LARGE_INTEGER f, t;
+		::QueryPerformanceFrequency(&f);
+		::QueryPerformanceCounter(&t);
+		frequency = f.QuadPart;
+
+		// Time zero is the process creation, so the trace also shows what it took to reach wWinMain
+		FILETIME created, exited, kernel, user, now_ft;
+		::GetProcessTimes(::GetCurrentProcess(), &created, &exited, &kernel, &user);
+		::GetSystemTimePreciseAsFileTime(&now_ft);
+		LONGLONG since_created = (LONGLONG)(Util::file_time(now_ft) - Util::file_time(created));
+		origin = t.QuadPart - since_created * frequency / 10000000;
+		enabled = true;
+		record("startup", origin, t.QuadPart, false);
 	}
-	bool load(const void* src, size_t src_size) {
-		grow(src_size + size);
-		memcpy(data + size, src, src_size);
-		size += src_size;
-		return true;
+	static void add(Counter counter, size_t n) {
+		if (on()) counters[counter] += n;
 	}
-	bool load(const String& file_path) {
-		FileWrap f(file_path, L"rb");
-		if (!f.is_open()) {
-			return false;
-		}
-		size_t file_size = f.size();
-		if (!file_size) {
-			return false;
-		}
-		grow(file_size + size);
-		f.read(data + size, file_size);
-		size += file_size;
-		return true;
+	// Instant event with a resource sample
+	static void mark(const char* name) {
+		if (on()) record(name, now(), 0, true);
 	}
-	bool save(const String& file_path) {
-		FileWrap f(file_path, L"wb");
-		if (!f.is_open()) {
-			return false;
+
+	// Times the enclosing scope as one phase
+	struct Phase {
+		const char* name;
+		LONGLONG    begin;
+		Phase(const char* phase_name) : name(phase_name), begin(on() ? now() : 0) {}
+		~Phase() { if (begin) record(name, begin, now(), false); }
+	};
+
+	// Writes the trace in Chrome trace event format (chrome://tracing, Perfetto) and starts the next one
+	static void write() {
+		if (!on()) return;
+		mark("write");
+		std::lock_guard<std::mutex> lock(mutex);
+		FILE* f = _wfopen(path.c_str(), L"wb");
+		if (!f) return;
+
+		DWORD pid = ::GetCurrentProcessId();
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+		for (size_t i = 0; i < events.size(); i++) {
+			const Event& e = events[i];
+			fprintf(f, "%s\n{\"name\":\"%s\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.1f,", i ? "," : "", e.name, (unsigned long)pid, (unsigned long)e.thread, us(e.begin));
+			if (e.end) {
+				fprintf(f, "\"ph\":\"X\",\"dur\":%.1f}", us(e.end) - us(e.begin));
+				continue;
+			}
+			fprintf(f, "\"ph\":\"i\",\"s\":\"p\"}");
+			if (e.sampled) {
+				fprintf(f, ",\n{\"name\":\"resources\",\"pid\":%lu,\"ts\":%.1f,\"ph\":\"C\",\"args\":{\"gdi_handles\":%lu,\"user_handles\":%lu,\"working_set\":%llu,\"private_bytes\":%llu}}",
+					(unsigned long)pid, us(e.begin), (unsigned long)e.resources.gdi_handles, (unsigned long)e.resources.user_handles,
+					(unsigned long long)e.resources.working_set, (unsigned long long)e.resources.private_bytes);
+			}
 		}
-		f.write(data, size);
-		return true;
+		static const char* counter_names[COUNTER_COUNT] = { "items_scanned", "icons_extracted", "icons_reused", "groups_decoded", "cache_bytes_read", "cache_bytes_written", "prefetch_bytes" };
+		fprintf(f, "\n],\n\"counters\":{");
+		for (int c = 0; c < COUNTER_COUNT; c++) {
+			fprintf(f, "%s\"%s\":%llu", c ? "," : "", counter_names[c], (unsigned long long)counters[c].exchange(0));
+		}
+		Resources r = resources();
+		fprintf(f, "},\n\"resources\":{\"gdi_handles\":%lu,\"user_handles\":%lu,\"working_set\":%llu,\"peak_working_set\":%llu,\"private_bytes\":%llu}}\n",
+			(unsigned long)r.gdi_handles, (unsigned long)r.user_handles, (unsigned long long)r.working_set, (unsigned long long)r.peak_working_set, (unsigned long long)r.private_bytes);
+		fclose(f);
+		events.clear();
 	}
 
 private:
-	struct FileWrap {
-		FILE* f;
-		FileWrap(const String& path, const String& mode) { f = _wfopen(path.c_str(), mode.c_str()); }
-		~FileWrap() { f&& fclose(f); f = 0; }
-		bool    is_open() { return f != 0; }
-		size_t  write(Byte* data, size_t size) { return fwrite(data, 1, size, f); }
-		size_t  read(Byte* data, size_t size) { return fread(data, 1, size, f); }
-		size_t  size() {
-			fseek(f, 0L, SEEK_END);
-			size_t file_size = ftell(f);
-			fseek(f, 0L, SEEK_SET);
-			return file_size;
-		}
+	struct Resources {
+		DWORD   gdi_handles;
+		DWORD   user_handles;
+		SIZE_T  working_set;
+		SIZE_T  peak_working_set;
+		SIZE_T  private_bytes;
 	};
-	void grow(size_t new_capacity) {
-		if (capacity >= new_capacity) {
-			return;
+	struct Event {
+		const char* name;
+		LONGLONG    begin;
+		LONGLONG    end;        // 0 for instant events
+		DWORD       thread;
+		bool        sampled;
+		Resources   resources;
+	};
+
+	inline static bool      enabled = false;
+	inline static String    path;
+	inline static LONGLONG  frequency = 1;
+	inline static LONGLONG  origin = 0;
+	inline static std::mutex mutex;     // phases are also timed on refresh and extraction threads
+	inline static std::vector<Event> events;
+	inline static std::atomic<size_t> counters[COUNTER_COUNT];
+
+	static LONGLONG now() {
+		LARGE_INTEGER t;
+		::QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+	static double us(LONGLONG ticks) {
+		return (double)(ticks - origin) * 1000000.0 / (double)frequency;
+	}
+	static Resources resources() {
+		HANDLE process = ::GetCurrentProcess();
+		Resources r = { ::GetGuiResources(process, GR_GDIOBJECTS), ::GetGuiResources(process, GR_USEROBJECTS), 0, 0, 0 };
+		PROCESS_MEMORY_COUNTERS_EX pmc = {};
+		pmc.cb = sizeof(pmc);
+		if (::GetProcessMemoryInfo(process, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc))) {
+			r.working_set = pmc.WorkingSetSize;
+			r.peak_working_set = pmc.PeakWorkingSetSize;
+			r.private_bytes = pmc.PrivateUsage;
+		}
+		return r;
+	}
+	static void record(const char* name, LONGLONG begin, LONGLONG end, bool sampled) {
+		Event e = { name, begin, end, ::GetCurrentThreadId(), sampled, {} };
+		if (sampled) e.resources = resources();
+		std::lock_guard<std::mutex> lock(mutex);
+		events.push_back(e);
+	}
+};
+
+// Read-only view of a whole file. Pointers into `data` stay valid until close().
+struct MappedFile : ByteView {
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const String& file_path) {
+		close();
+		// FILE_SHARE_DELETE lets a rebuild rename the file away while it is still mapped
+		HANDLE file = ::CreateFile(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
 		}
-		size_t new_cap = capacity ? capacity : 256;
-		while (new_cap < new_capacity) {
-			new_cap *= 2;
+		LARGE_INTEGER file_size = { 0 };
+		if (::GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+			HANDLE mapping = ::CreateFileMapping(file, 0, PAGE_READONLY, 0, 0, 0);
+			if (mapping) {
+				// The view keeps the section alive, both handles can go right away
+				data = (const Byte*)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				::CloseHandle(mapping);
+			}
 		}
-		Byte* new_data = new Byte[new_cap];
+		::CloseHandle(file);
+		size = data ? (size_t)file_size.QuadPart : 0;
+		return data != 0;
+	}
+	void close() {
 		if (data) {
-			memcpy(new_data, data, size);
-			delete[] data;
+			::UnmapViewOfFile(data);
+			data = 0;
 		}
-		data = new_data;
-		capacity = new_cap;
+		size = 0;
 	}
 };
 
 /**************************************************************************************************
- * Cache
+ * Icon atlas: all icons of a stack in one DIB section, addressed by slot
  **************************************************************************************************/
+struct IconAtlas {
+	enum { COLUMNS = 32 };
+
+	int     cell;       // icon size in pixels
+	int     columns;
+	int     rows;
+	Byte*   bits;       // top-down 32bpp premultiplied BGRA
+	HBITMAP hBmp;
+	HDC     dc;         // long-lived memory DC with the atlas selected, used for every blit
+
+	IconAtlas() : cell(0), columns(0), rows(0), bits(0), hBmp(0), dc(0), old_bmp(0) {}
+	~IconAtlas() { close(); }
+	IconAtlas(const IconAtlas&) = delete;
+	IconAtlas& operator=(const IconAtlas&) = delete;
+
+	bool create(size_t slot_count, int cell_size) {
+		close();
+		cell = cell_size;
+		columns = (int)max((size_t)1, min(slot_count, (size_t)COLUMNS));
+		rows = (int)max((size_t)1, (slot_count + columns - 1) / columns);
 
-struct Bmp {
-
-	BITMAPFILEHEADER    file_header;
-	BITMAPINFOHEADER    info_header;
-	Buffer              bits;
-	HBITMAP             hBmp;
-
-	Bmp() : hBmp(0) {
-		memset(&file_header, 0, sizeof(BITMAPFILEHEADER));
-		memset(&info_header, 0, sizeof(BITMAPINFOHEADER));
+		BITMAPINFO bmi = { 0 };
+		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.bmiHeader.biWidth = columns * cell;
+		bmi.bmiHeader.biHeight = -(rows * cell);   // top-down
+		bmi.bmiHeader.biPlanes = 1;
+		bmi.bmiHeader.biBitCount = 32;
+		bmi.bmiHeader.biCompression = BI_RGB;
+		hBmp = ::CreateDIBSection(0, &bmi, DIB_RGB_COLORS, (void**)&bits, 0, 0);
+		if (!hBmp) {
+			bits = 0;
+			return false;
+		}
+		dc = ::CreateCompatibleDC(0);
+		old_bmp = ::SelectObject(dc, hBmp);
+		return true;
 	}
-
 	void close() {
-		::DeleteObject(hBmp);
-		bits.free();
-		hBmp = 0;
-		memset(&file_header, 0, sizeof(BITMAPFILEHEADER));
-		memset(&info_header, 0, sizeof(BITMAPINFOHEADER));
+		if (dc) {
+			::SelectObject(dc, old_bmp);
+			::DeleteDC(dc);
+			dc = 0;
+		}
+		if (hBmp) {
+			::DeleteObject(hBmp);
+			hBmp = 0;
+		}
+		bits = 0;
+		cell = columns = rows = 0;
 	}
-	int total_size() {
-		return file_header.bfSize;
+	bool has_slot(int slot) const {
+		return bits && slot >= 0 && slot < columns * rows;
 	}
-	int bits_size() {
-		return file_header.bfSize - sizeof(BITMAPINFOHEADER) - sizeof(BITMAPFILEHEADER);
+	size_t stride() const {
+		return (size_t)columns * cell * sizeof(DWORD);
 	}
-	bool load_bits_and_headers(Byte* bytes) {
-		close();
-		int pos = 0;
-		memcpy(&file_header, bytes + pos, sizeof(BITMAPFILEHEADER));
-		pos += sizeof(BITMAPFILEHEADER);
-		memcpy(&info_header, bytes + pos, sizeof(BITMAPINFOHEADER));
-		pos += sizeof(BITMAPINFOHEADER);
-		return fill_bitmap(bytes + pos, bits_size());
-	}
-	bool load_bits_only(Byte* bytes, int bits_size, int width, int height) {
-		close();
-		memset(&file_header, 0, sizeof(BITMAPFILEHEADER));
-		file_header.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + bits_size;
-		file_header.bfType = 0x4d42;
-		file_header.bfOffBits = 0x36;
-		info_header = create_info_header(width, height);
-		return fill_bitmap(bytes, bits_size);
-	}
-	bool serialize(Buffer& buffer) {
-		buffer.load(&file_header, sizeof(BITMAPFILEHEADER));
-		buffer.load(&info_header, sizeof(BITMAPINFOHEADER));
-		buffer.load(bits.data, bits.size);
-		return true;
+	size_t cell_bytes() const {
+		return (size_t)cell * cell * sizeof(DWORD);
 	}
-	static BITMAPINFOHEADER create_info_header(int width, int height) {
-		BITMAPINFOHEADER bmih = { 0 };
-		bmih.biSize = sizeof(BITMAPINFOHEADER);
-		bmih.biWidth = width;
-		bmih.biHeight = height;
-		bmih.biPlanes = 1;
-		bmih.biBitCount = 32;
-		bmih.biCompression = BI_RGB;
-		return bmih;
-	}
-	static bool convert_file_icon(const HICON icon, Bmp& bmp) {
-		static IWICImagingFactory* img_factory = 0;
-		if (!img_factory) {
-			// In VS 2011 beta, clsid has to be changed to CLSID_WICImagingFactory1 (from CLSID_WICImagingFactory)
-			if (!SUCCEEDED(::CoInitialize(0)) || !SUCCEEDED(::CoCreateInstance(CLSID_WICImagingFactory1, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&img_factory)))) {
-				return false;
-			}
+	Byte* cell_bits(int slot) const {
+		return bits + (size_t)(slot / columns) * cell * stride() + (size_t)(slot % columns) * cell * sizeof(DWORD);
+	}
+	// A slot's first row for writing in place; rows are stride() bytes apart
+	Byte* begin_write(int slot) {
+		::GdiFlush();
+		return cell_bits(slot);
+	}
+	// Copies packed cell-sized rows into a slot
+	void write(int slot, const Byte* src) {
+		::GdiFlush();
+		size_t row_bytes = cell * sizeof(DWORD);
+		Byte* dst = cell_bits(slot);
+		for (int y = 0; y < cell; y++, dst += stride(), src += row_bytes) {
+			memcpy(dst, src, row_bytes);
 		}
-		IWICBitmap* pBitmap = 0;
-		IWICFormatConverter* pConverter = 0;
-		UINT cx = 0, cy = 0;
-		if (SUCCEEDED(img_factory->CreateBitmapFromHICON(icon, &pBitmap))) {
-			if (SUCCEEDED(img_factory->CreateFormatConverter(&pConverter))) {
-				if (SUCCEEDED(pConverter->Initialize(pBitmap, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, 0, 0.0f, WICBitmapPaletteTypeCustom))) {
-					if (SUCCEEDED(pConverter->GetSize(&cx, &cy))) {
-						const UINT stride = cx * sizeof(DWORD);
-						const UINT buf_size = cy * stride;
-						Byte* buf = new Byte[buf_size];
-						pConverter->CopyPixels(0, stride, buf_size, buf);
-						bmp.load_bits_only(buf, buf_size, cx, -(int)cy);
-						delete[] buf;
-					}
-				}
-				pConverter->Release();
-			}
-			pBitmap->Release();
+	}
+	void clear(int slot) {
+		::GdiFlush();
+		size_t row_bytes = cell * sizeof(DWORD);
+		Byte* dst = cell_bits(slot);
+		for (int y = 0; y < cell; y++, dst += stride()) {
+			memset(dst, 0, row_bytes);
 		}
-		::DestroyIcon(icon);
-
-		return true;
 	}
-	static HICON extract_file_icon(const String& file_path) {
-		SHFILEINFOW file_info = { 0 };
-		HIMAGELIST hfi = (HIMAGELIST)::SHGetFileInfo(file_path.c_str(), 0, &file_info, sizeof(SHFILEINFOW), SHGFI_SYSICONINDEX | SHGFI_SMALLICON);
-		return ::ImageList_GetIcon(hfi, file_info.iIcon, ILD_NORMAL);
+	void draw(HDC target, int slot, int x, int y, int size, BYTE alpha) const {
+		if (!has_slot(slot)) {
+			return;
+		}
+		BLENDFUNCTION bf{};
+		bf.BlendOp = AC_SRC_OVER;
+		bf.SourceConstantAlpha = alpha;
+		bf.AlphaFormat = AC_SRC_ALPHA;
+		::AlphaBlend(target, x, y, size, size, dc, (slot % columns) * cell, (slot / columns) * cell, cell, cell, bf);
 	}
 
-	static HICON extract_icon_from_path_with_index(const String& icon_path) {
+private:
+	HGDIOBJ old_bmp;
+};
+
+/**************************************************************************************************
+ * Cache
+ **************************************************************************************************/
+
+struct Bmp {
+
+	// Icon from a desktop.ini IconResource ("path.dll,2"), extracted at `size` pixels from the icon resource itself
+	static HICON extract_icon_from_path_with_index(const String& icon_path, int size) {
 		HICON hIcon = 0;
 		String path = icon_path;
 		int icon_index = 0;
@@ -469,333 +578,1991 @@ struct Bmp {
 		// Expand environment variables if present
 		TCHAR expanded_path[MAX_PATH] = { 0 };
 		::ExpandEnvironmentStrings(path.c_str(), expanded_path, MAX_PATH);
-		path = expanded_path;
-
-		// Extract small icon (16x16) instead of large icon (32x32)
-		::ExtractIconEx(path.c_str(), icon_index, 0, &hIcon, 1);
 
-		if (!hIcon) {
-			// Fallback to default file icon
-			hIcon = extract_file_icon(path);
+		// Picks the best image of the resource for the size instead of scaling the 16px one
+		if (FAILED(::SHDefExtractIcon(expanded_path, icon_index, 0, &hIcon, nullptr, size))) {
+			hIcon = 0;
 		}
-
 		return hIcon;
 	}
 
-private:
-	bool fill_bitmap(void* bytes, int byte_count) {
-		Byte* buf = 0;
-		if (!create_bitmap(info_header.biWidth, info_header.biHeight, (void**)(&buf), &hBmp)) {
-			return false;
-		}
-		memcpy(buf, bytes, byte_count);
-		return bits.load(bytes, byte_count);
-	}
-	static bool create_bitmap(int width, int height, void** bits, HBITMAP* phBmp) {
-		BITMAPINFO bmi = { 0 };
-		bmi.bmiHeader = create_info_header(width, height);
-		*phBmp = ::CreateDIBSection(GetDC(0), &bmi, DIB_RGB_COLORS, bits, 0, 0);
-		return *phBmp != 0;
-	}
 };
 
-struct Cache {
-
-	struct Item {
-		String  name;
-		Bmp     bmp;
-		bool    is_submenu;
-		String  submenu_path;
-		String  relative_path; // For items in submenus
-
-		Item() : is_submenu(false) {}
-
-		bool create(const String& file_name, const String& file_path) {
-			name = file_name;
-			is_submenu = false;
-			submenu_path.clear();
-			relative_path.clear();
-
-			DWORD attrs = ::GetFileAttributes(file_path.c_str());
-			if (attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY)) {
-
-				// Mark as submenu if needed
-				if (Util::ends_with(file_name, SUBMENU_SUFFIX)) {
-					is_submenu = true;
-					submenu_path = file_path;
-				}
-
-				// For ANY folder: try custom icon from desktop.ini first
-				String icon_path = Util::ReadIconFromDesktopIni(file_path);
-				if (!icon_path.empty()) {
-					HICON hIcon = Bmp::extract_icon_from_path_with_index(icon_path);
-					if (hIcon) {
-						if (Bmp::convert_file_icon(hIcon, bmp)) {
-							return true;
-						}
-					}
-				}
-
-				// Fallback to normal folder icon
-				if (Bmp::convert_file_icon(Bmp::extract_file_icon(file_path), bmp)) {
-					return true;
+// Per-thread icon conversion. Every extraction thread runs in its own COM apartment with its own WIC factory.
+struct IconExtractor {
+
+	IconExtractor() : factory(0) {
+		com = ::CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+		// In VS 2011 beta, clsid has to be changed to CLSID_WICImagingFactory1 (from CLSID_WICImagingFactory)
+		::CoCreateInstance(CLSID_WICImagingFactory1, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory));
+
+		// Each stored size comes from the smallest system image list that is at least as large, so it is only scaled down
+		static const int lists[] = { SHIL_SMALL, SHIL_LARGE, SHIL_EXTRALARGE };
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			image_lists[s] = 0;
+			for (int list : lists) {
+				HIMAGELIST hil = 0;
+				int cx = 0, cy = 0;
+				if (SUCCEEDED(::SHGetImageList(list, IID_IImageList, (void**)&hil)) && ::ImageList_GetIconSize(hil, &cx, &cy)) {
+					image_lists[s] = hil;
+					if (cx >= (int)ICON_SIZES[s]) break;
 				}
 			}
+		}
+	}
+	~IconExtractor() {
+		if (factory) factory->Release();
+		if (SUCCEEDED(com)) ::CoUninitialize();
+	}
+	IconExtractor(const IconExtractor&) = delete;
+	IconExtractor& operator=(const IconExtractor&) = delete;
 
-			// Regular item - use original extraction method
-			if (!Bmp::convert_file_icon(Bmp::extract_file_icon(file_path), bmp)) {
+	// The shell icon of a file or folder in all ICON_SIZES, written as an icon set
+	bool convert_file_icon(const String& file_path, Byte* icon_set) {
+		SHFILEINFOW file_info = { 0 };
+		if (!::SHGetFileInfo(file_path.c_str(), 0, &file_info, sizeof(SHFILEINFOW), SHGFI_SYSICONINDEX)) {
+			return false;
+		}
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			HICON icon = image_lists[s] ? ::ImageList_GetIcon(image_lists[s], file_info.iIcon, ILD_NORMAL) : 0;
+			if (!convert(icon, ICON_SIZES[s], icon_set + CacheCore::icon_set_offset(s))) {
 				return false;
 			}
-
-			return true;
 		}
-		void serialize(Buffer& buffer) {
-			buffer.load(name, true);
-			buffer.load(&is_submenu, sizeof(is_submenu));
-			if (is_submenu) {
-				buffer.load(submenu_path, true);
+		return true;
+	}
+
+	// A desktop.ini icon in all ICON_SIZES, written as an icon set
+	bool convert_icon_resource(const String& icon_path, Byte* icon_set) {
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			if (!convert(Bmp::extract_icon_from_path_with_index(icon_path, ICON_SIZES[s]), ICON_SIZES[s], icon_set + CacheCore::icon_set_offset(s))) {
+				return false;
 			}
-			bmp.serialize(buffer);
 		}
-		void unserialize(Buffer& buffer, size_t& pos) {
-			name = (Char*)(buffer.data + pos);
-			pos += (name.size() + 1) * sizeof(Char);
-
-			memcpy(&is_submenu, buffer.data + pos, sizeof(is_submenu));
-			pos += sizeof(is_submenu);
+		return true;
+	}
 
-			if (is_submenu) {
-				submenu_path = (Char*)(buffer.data + pos);
-				pos += (submenu_path.size() + 1) * sizeof(Char);
+	// Converts the icon to premultiplied BGRA scaled to size x size, written as packed rows. Destroys the icon.
+	bool convert(const HICON icon, U32 size, Byte* pixels) {
+		IWICBitmap* pBitmap = 0;
+		IWICFormatConverter* pConverter = 0;
+		IWICBitmapScaler* pScaler = 0;
+		UINT cx = 0, cy = 0;
+		bool converted = false;
+		if (icon && factory && SUCCEEDED(factory->CreateBitmapFromHICON(icon, &pBitmap))) {
+			if (SUCCEEDED(factory->CreateFormatConverter(&pConverter))) {
+				if (SUCCEEDED(pConverter->Initialize(pBitmap, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, 0, 0.0f, WICBitmapPaletteTypeCustom))) {
+					IWICBitmapSource* source = pConverter;
+					if (SUCCEEDED(pConverter->GetSize(&cx, &cy)) && (cx != size || cy != size)) {
+						if (SUCCEEDED(factory->CreateBitmapScaler(&pScaler)) && SUCCEEDED(pScaler->Initialize(pConverter, size, size, WICBitmapInterpolationModeFant))) {
+							source = pScaler;
+						}
+					}
+					const UINT stride = size * sizeof(DWORD);
+					converted = SUCCEEDED(source->CopyPixels(0, stride, stride * size, pixels));
+					if (pScaler) pScaler->Release();
+				}
+				pConverter->Release();
 			}
-
-			bmp.load_bits_and_headers(buffer.data + pos);
-			pos += bmp.total_size();
+			pBitmap->Release();
 		}
-	};
+		if (icon) ::DestroyIcon(icon);
 
+		return converted;
+	}
 
-	std::vector<Item>   items;
-	int                 fixed_items;
-	bool                was_rebuilt;
-	String              base_dir;
+private:
+	HRESULT             com;
+	IWICImagingFactory* factory;
+	HIMAGELIST          image_lists[ICON_SIZE_COUNT];   // source of each stored size
+};
 
-	Cache(const String& stack_path) : last_modified(0), was_rebuilt(false), scanned_last_modified(0), fixed_items(0) {
-		base_dir = Util::trim(Util::rtrim(stack_path, DIR_SEP), L"\"") + DIR_SEP;
-		cache_path = path(CACHE_FILE_NAME);
-	}
+/**************************************************************************************************
+ * Shared icon store: with --shared-icons, extracted icons are also kept per user in %LOCALAPPDATA%\stacky\icons,
+ * one file per icon source, so the same program in another stack is not extracted again. Files are touched
+ * when used and the least recently used ones go once the store is over MAX_BYTES.
+ **************************************************************************************************/
+struct IconStore {
+	enum { MAX_BYTES = 32 * 1024 * 1024 };
 
-	String path(const String& file = L"") const {
-		return base_dir + file;
+	static bool on() {
+		return !dir.empty();
 	}
-
-	bool scan() {
-		return scan_directory(base_dir, L"");
+	static void enable() {
+		Char local[MAX_PATH] = { 0 };
+		if (!::ExpandEnvironmentStrings(L"%LOCALAPPDATA%\\stacky", local, MAX_PATH) || local[0] == L'%') {
+			return;
+		}
+		String path = String(local) + L"\\icons\\";
+		::CreateDirectory(local, 0);
+		::CreateDirectory(path.c_str(), 0);
+		if (::GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES) {
+			dir = path;
+		}
 	}
 
-	bool scan_directory(const String& dir_path, const String& relative_path) {
-		WIN32_FIND_DATA ffd = { 0 };
-		HANDLE hfind = FindFirstFile((dir_path + L"*").c_str(), &ffd);
-		if (hfind == INVALID_HANDLE_VALUE) {
-			return false;
+	// Identity of the image a file shows: the icon location or target of a shortcut, or the program itself,
+	// with the write time of that file. 0 for files whose icon is not shared. Needs COM on the calling thread.
+	static Hash key(const String& file_path) {
+		String source = file_path;
+		int index = 0;
+		String lower = file_path;
+		::CharLowerBuff(&lower[0], (DWORD)lower.size());
+		if (Util::ends_with(lower, L".lnk")) {
+			if (!shortcut_source(file_path, source, index)) return 0;
 		}
-		do {
-			String filename = ffd.cFileName;
-			if (filename == L"." || filename == L".." || ffd.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN || Util::ends_with(filename, L".ignore") || filename == DESKTOP_INI)
-				continue;
-
-			String full_filename = relative_path + filename;
-			scanned_items.push_back(full_filename);
-			update_max_modified(full_filename);
-
-			// If this is a .submenu folder, recursively scan it
-			if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
-				Util::ends_with(filename, SUBMENU_SUFFIX)) {
-				scan_directory(dir_path + filename + DIR_SEP, full_filename + DIR_SEP);
-			}
-		} while (FindNextFile(hfind, &ffd) != 0);
-		FindClose(hfind);
-		return true;
+		else if (!Util::ends_with(lower, L".exe")) {
+			return 0;
+		}
+		WIN32_FILE_ATTRIBUTE_DATA fad = { 0 };
+		if (!::GetFileAttributesEx(source.c_str(), GetFileExInfoStandard, &fad)) {
+			return 0;
+		}
+		::CharLowerBuff(&source[0], (DWORD)source.size());
+		U64 write_time = Util::file_time(fad.ftLastWriteTime);
+		Util::Hasher hasher;
+		hasher.add(&CACHE_VERSION, sizeof(CACHE_VERSION));
+		hasher.add(source.data(), source.size() * sizeof(Char));
+		hasher.add(&index, sizeof(index));
+		hasher.add(&write_time, sizeof(write_time));
+		return hasher.value();
 	}
 
-	bool load() {
-		Buffer buffer;
-		items.clear();
-
-		if (!buffer.load(cache_path)) {
-			// Cache file doesn't exist, will rebuild
-			rebuild();
-			was_rebuilt = true;
-			return true;
+	// Reads a stored icon set; a hit makes it the most recently used
+	static bool find(Hash key, Byte* icon_set) {
+		String path = file(key);
+		Buffer data;
+		if (!data.load(path)) {
+			return false;
 		}
-
-		// Check cache version
+		ByteView view(data.data, data.size);
 		size_t pos = 0;
-		if (buffer.size < sizeof(DWORD)) {
-			// Invalid or old cache format
-			rebuild();
-			was_rebuilt = true;
-			return true;
+		bool found = true;
+		for (size_t s = 0; found && s < ICON_SIZE_COUNT; s++) {
+			U32 size = 0;
+			found = view.read(pos, &size, sizeof(size)) && size <= view.size - pos &&
+				IconCodec::decode(view.data + pos, size, icon_set + CacheCore::icon_set_offset(s), ICON_SIZES[s] * ICON_SIZES[s]);
+			pos += size;
 		}
+		data.free();
+		if (found) touch(path);
+		return found;
+	}
 
-		DWORD version = 0;
-		memcpy(&version, buffer.data + pos, sizeof(DWORD));
-		pos += sizeof(DWORD);
-
-		if (version != CACHE_VERSION) {
-			// Cache format changed, rebuild
-			rebuild();
-			was_rebuilt = true;
-			return true;
+	// Stores an icon set: per size, U32 length and the IconCodec data
+	static void add(Hash key, const Byte* icon_set) {
+		Buffer data;
+		std::vector<Byte> encoded(IconCodec::max_size(ICON_SIZES[ICON_SIZE_COUNT - 1] * ICON_SIZES[ICON_SIZE_COUNT - 1]));
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			U32 size = (U32)IconCodec::encode(icon_set + CacheCore::icon_set_offset(s), ICON_SIZES[s] * ICON_SIZES[s], encoded.data());
+			data.load(&size, sizeof(size));
+			data.load(encoded.data(), size);
 		}
-
-		// Load items
-		for (; pos < buffer.size; ) {
-			Item item;
-			item.unserialize(buffer, pos);
-			items.push_back(item);
+		// Written aside and renamed, so other stackies never read half a file
+		String path = file(key);
+		String tmp_path = path + L"." + std::to_wstring(::GetCurrentThreadId()) + L".tmp";
+		if (data.save(tmp_path) && ::MoveFileEx(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			added++;
 		}
-		last_modified = Util::get_modified(cache_path);
-
-		if (is_outdated()) {
-			rebuild();
-			was_rebuilt = true;
+		else {
+			::DeleteFile(tmp_path.c_str());
 		}
+		data.free();
+	}
 
-		return true;
+	// After icons were added: drops the least recently used files beyond MAX_BYTES
+	static void trim() {
+		if (!on() || !added.exchange(0)) {
+			return;
+		}
+		struct Stored {
+			U64     used;
+			U64     size;
+			String  name;
+		};
+		std::vector<Stored> stored;
+		U64 total = 0;
+		WIN32_FIND_DATA ffd = { 0 };
+		HANDLE hfind = ::FindFirstFile((dir + L"*.icon").c_str(), &ffd);
+		if (hfind == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		do {
+			U64 size = ((U64)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+			stored.push_back(Stored{ Util::file_time(ffd.ftLastWriteTime), size, ffd.cFileName });
+			total += size;
+		} while (::FindNextFile(hfind, &ffd));
+		::FindClose(hfind);
+		if (total <= MAX_BYTES) {
+			return;
+		}
+		std::sort(stored.begin(), stored.end(), [](const Stored& a, const Stored& b) { return a.used < b.used; });
+		for (size_t i = 0; i < stored.size() && total > MAX_BYTES; i++) {
+			if (::DeleteFile((dir + stored[i].name).c_str())) total -= stored[i].size;
+		}
 	}
 
 private:
-	String      cache_path;
-	Time        last_modified;
-	StringList  scanned_items;
-	Time        scanned_last_modified;
-
-	bool rebuild() {
-		Buffer buffer;
-		items.clear();
-
-		// Write cache version first
-		buffer.load(&CACHE_VERSION, sizeof(CACHE_VERSION));
-
-		Item item;
-		item.create(Util::rtrim(path(), DIR_SEP), path());
-		item.serialize(buffer);
-		items.push_back(item);
-		for (size_t i = 0; i < scanned_items.size(); i++) {
-			String file_name = scanned_items[i];
-			item.create(file_name, path(file_name));
-			item.serialize(buffer);
-			items.push_back(item);
-		}
+	inline static String    dir;    // empty when off
+	inline static std::atomic<size_t> added;
 
-		save(buffer);
-		return true;
-	}
-	void save(Buffer buffer) {
-		::DeleteFile(cache_path.c_str());
-		buffer.save(cache_path);
-		::SetFileAttributes(cache_path.c_str(), FILE_ATTRIBUTE_HIDDEN);
-	}
-	void update_max_modified(const String& filename) {
-		Time ft = Util::get_modified(path(filename));
-		scanned_last_modified = scanned_last_modified < ft ? ft : scanned_last_modified;
+	static String file(Hash key) {
+		Char name[32];
+		::StringCchPrintf(name, _countof(name), L"%016llx.icon", (unsigned long long)key);
+		return dir + name;
 	}
-	bool is_outdated() {
-		if (scanned_last_modified > last_modified || items.size() < 1 || scanned_items.size() + 1 != items.size()) {
-			return true;
+	// Recency is the write time, which is cheap to set and comes with every FindFirstFile listing
+	static void touch(const String& path) {
+		HANDLE f = ::CreateFile(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0);
+		if (f == INVALID_HANDLE_VALUE) {
+			return;
 		}
-		for (size_t i = 0; i < scanned_items.size(); i++) if (scanned_items[i] != items[i + 1].name) {
-			return true;
+		FILETIME now;
+		::GetSystemTimeAsFileTime(&now);
+		::SetFileTime(f, 0, 0, &now);
+		::CloseHandle(f);
+	}
+	// Where a shortcut's icon comes from, without resolving it (that may search the disk)
+	static bool shortcut_source(const String& link_path, String& source, int& index) {
+		IShellLink* link = 0;
+		IPersistFile* file = 0;
+		bool found = false;
+		if (SUCCEEDED(::CoCreateInstance(CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER, IID_IShellLink, (LPVOID*)&link))) {
+			if (SUCCEEDED(link->QueryInterface(IID_IPersistFile, (void**)&file))) {
+				Char location[MAX_PATH] = { 0 };
+				if (SUCCEEDED(file->Load(link_path.c_str(), STGM_READ))) {
+					if (FAILED(link->GetIconLocation(location, MAX_PATH, &index)) || !location[0]) {
+						index = 0;
+						link->GetPath(location, MAX_PATH, nullptr, SLGP_RAWPATH);
+					}
+				}
+				Char expanded[MAX_PATH] = { 0 };
+				if (location[0] && ::ExpandEnvironmentStrings(location, expanded, MAX_PATH)) {
+					source = expanded;
+					found = true;
+				}
+				file->Release();
+			}
+			link->Release();
 		}
-		return false;
+		return found;
 	}
 };
 
-struct MenuEntry {
-	Cache::Item* item;     // points to cache item (folder or file)
-	String text;           // display text (trimmed)
-	bool is_submenu;
-	bool populated;        // for lazy submenus
-	String submenu_prefix; // relative prefix like L\"Foo.submenu\\\\\"
-	bool is_path = false;
-};
-
 /**************************************************************************************************
- * DPI-aware icon cache for owner-draw
+ * Prefetcher: reads the program behind a hovered menu item into the file cache, so a click on it
+ * does not wait for cold disk reads. One background thread; a new request or cancel() stops the
+ * file being read at the next check.
  **************************************************************************************************/
-struct IconCache {
-	struct Entry { HBITMAP bmp; SIZE sz; };
-	std::unordered_map<const void*, Entry> map;
-
-	Entry& get(HWND hwnd, HBITMAP src) {
-		auto it = map.find(src);
-		if (it != map.end()) return it->second;
+struct Prefetcher {
+	enum {
+		BUDGET = 64 << 20,      // bytes read per menu
+		FILE_LIMIT = 32 << 20,  // bytes read per file
+		MAX_IMPORTS = 32,       // import descriptors looked at per program
+		PAGE = 4096,
+		CANCEL_CHECK = 64,      // pages between cancel checks
+	};
 
-		UINT dpi = GetDpiForWindow(hwnd);
-		int s = MulDiv(16, dpi, 96);
-		HBITMAP scaled = (HBITMAP)CopyImage(src, IMAGE_BITMAP, s, s, LR_CREATEDIBSECTION);
-		return map[src] = { scaled, {s, s} };
+	Prefetcher() : generation(0), stopping(false), session(0), worker_session(0), spent(0) {}
+	~Prefetcher() { stop(); }
+
+	// Replaces the request being served, if any
+	void request(const String& program) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping) return;
+		if (!worker.joinable()) worker = std::thread(&Prefetcher::run, this);
+		next = program;
+		generation++;
+		wake.notify_one();
 	}
-
-	~IconCache() {
-		for (auto& kv : map) DeleteObject(kv.second.bmp);
+	void cancel() {
+		std::lock_guard<std::mutex> lock(mutex);
+		next.clear();
+		generation++;
 	}
-};
-
-/**************************************************************************************************
- * Lazy submenu payload
- **************************************************************************************************/
-struct LazySubmenuData {
-	Cache* cache;
-	String folder_path;
-};
-
-/**************************************************************************************************
- * The app
- **************************************************************************************************/
-struct App {
-
-	App(Cache* c, const String& options) : cache(c), window(0) {
-		hide_header = options.find(L"--hide-header") != String::npos;
-		compact_header = options.find(L"--compact-header") != String::npos;
-		dark_mode = options.find(L"--dark-mode") != String::npos;
+	// A new menu gets a fresh budget, and may warm files again that were evicted since
+	void new_session() {
+		std::lock_guard<std::mutex> lock(mutex);
+		session++;
+	}
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			generation++;
+		}
+		wake.notify_one();
+		if (worker.joinable()) worker.join();
 	}
 
-	bool init() {
-		// Create window
+private:
+	std::mutex              mutex;
+	std::condition_variable wake;
+	std::thread             worker;
+	String                  next;
+	std::atomic<U32>        generation;
+	bool                    stopping;
+	U32                     session;
+	// worker thread only
+	U32                     worker_session;
+	size_t                  spent;
+	std::unordered_map<String, StringList> warmed;  // fully read files by lowercase path, with a program's local imports
+	inline static volatile Byte sink;           // keeps the page touches from being optimized out
+
+	void run() {
+		// Low CPU and I/O priority: the page faults below must not slow down the menu or a launch
+		::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+		for (;;) {
+			String program;
+			U32 gen;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stopping || !next.empty(); });
+				if (stopping) return;
+				program.swap(next);
+				gen = generation;
+				if (worker_session != session) {
+					worker_session = session;
+					spent = 0;
+					warmed.clear();
+				}
+			}
+			Trace::Phase phase("prefetch");
+			StringList imports;
+			if (!warm(program, gen, &imports)) continue;
+			for (const String& dll : imports) {
+				if (!warm(dll, gen, nullptr)) break;
+			}
+		}
+	}
+
+	// Touches every page of `path`, and lists the DLLs next to it that it imports. False once
+	// cancelled or out of budget. Only a file read to the end counts as warmed, so hovering it again
+	// after a cancel goes on with it.
+	bool warm(const String& path, U32 gen, StringList* imports) {
+		String key = path;
+		::CharLowerBuff(&key[0], (DWORD)key.size());
+		auto found = warmed.find(key);
+		if (found != warmed.end()) {
+			// Its imports may be what got cancelled
+			if (imports) *imports = found->second;
+			return true;
+		}
+		MappedFile file;
+		if (!file.open(path)) {
+			return true;
+		}
+		size_t size = min(file.size, (size_t)FILE_LIMIT);
+		if (spent + size > BUDGET) {
+			return false;
+		}
+		for (size_t pos = 0; pos < size; pos += PAGE) {
+			if ((pos / PAGE) % CANCEL_CHECK == 0 && generation != gen) {
+				return false;
+			}
+			sink = file.data[pos];
+		}
+		spent += size;
+		Trace::add(Trace::PREFETCH_BYTES, size);
+		StringList& listed = warmed[key];
+		if (imports) {
+			local_imports(file, path.substr(0, path.find_last_of(L'\\') + 1), listed);
+			*imports = listed;
+		}
+		return generation == gen;
+	}
+
+	// The DLLs a program imports that sit in its own folder. System DLLs are shared by everything
+	// and usually cached already.
+	static void local_imports(const ByteView& file, const String& dir, StringList& imports) {
+		IMAGE_DOS_HEADER dos;
+		size_t pos = 0;
+		if (!file.read(pos, &dos, sizeof(dos)) || dos.e_magic != IMAGE_DOS_SIGNATURE || dos.e_lfanew < 0) {
+			return;
+		}
+		DWORD signature = 0;
+		IMAGE_FILE_HEADER header;
+		pos = (size_t)dos.e_lfanew;
+		if (!file.read(pos, &signature, sizeof(signature)) || signature != IMAGE_NT_SIGNATURE || !file.read(pos, &header, sizeof(header))) {
+			return;
+		}
+		// The data directories sit at a different offset in 32 and 64-bit optional headers
+		size_t optional = pos;
+		WORD magic = 0;
+		if (!file.read(pos, &magic, sizeof(magic))) {
+			return;
+		}
+		bool is64 = magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+		size_t count_pos = optional + (is64 ? offsetof(IMAGE_OPTIONAL_HEADER64, NumberOfRvaAndSizes) : offsetof(IMAGE_OPTIONAL_HEADER32, NumberOfRvaAndSizes));
+		DWORD dir_count = 0;
+		IMAGE_DATA_DIRECTORY import_dir;
+		if (!file.read(count_pos, &dir_count, sizeof(dir_count)) || dir_count <= IMAGE_DIRECTORY_ENTRY_IMPORT) {
+			return;
+		}
+		pos = count_pos + IMAGE_DIRECTORY_ENTRY_IMPORT * sizeof(IMAGE_DATA_DIRECTORY);
+		if (!file.read(pos, &import_dir, sizeof(import_dir)) || !import_dir.VirtualAddress) {
+			return;
+		}
+
+		std::vector<IMAGE_SECTION_HEADER> sections(header.NumberOfSections);
+		pos = optional + header.SizeOfOptionalHeader;
+		if (sections.empty() || !file.read(pos, sections.data(), sections.size() * sizeof(IMAGE_SECTION_HEADER))) {
+			return;
+		}
+		auto file_offset = [&](DWORD rva, size_t& offset) {
+			for (const IMAGE_SECTION_HEADER& s : sections) {
+				if (rva >= s.VirtualAddress && rva - s.VirtualAddress < max(s.Misc.VirtualSize, s.SizeOfRawData)) {
+					offset = (size_t)s.PointerToRawData + (rva - s.VirtualAddress);
+					return offset < file.size;
+				}
+			}
+			return false;
+		};
+
+		size_t desc_pos = 0;
+		if (!file_offset(import_dir.VirtualAddress, desc_pos)) {
+			return;
+		}
+		for (int i = 0; i < MAX_IMPORTS; i++) {
+			IMAGE_IMPORT_DESCRIPTOR desc;
+			size_t name_pos = 0;
+			if (!file.read(desc_pos, &desc, sizeof(desc)) || !desc.Name) {
+				return;
+			}
+			if (!file_offset(desc.Name, name_pos)) {
+				continue;
+			}
+			const char* name = (const char*)file.data + name_pos;
+			size_t len = strnlen(name, min(file.size - name_pos, (size_t)MAX_PATH));
+			String dll = dir + String(name, name + len);
+			DWORD attrs = ::GetFileAttributes(dll.c_str());
+			if (attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+				imports.push_back(dll);
+			}
+		}
+	}
+};
+
+// FindFirstFile-backed FileSystem for the stack scan
+struct Win32FileSystem : FileSystem {
+	bool list(const String& dir, std::vector<DirEntry>& entries) override {
+		WIN32_FIND_DATA ffd = { 0 };
+		HANDLE hfind = FindFirstFile((dir + L"*").c_str(), &ffd);
+		if (hfind == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		do {
+			if (!wcscmp(ffd.cFileName, L".") || !wcscmp(ffd.cFileName, L".."))
+				continue;
+			entries.push_back(DirEntry{
+				ffd.cFileName,
+				((ULONGLONG)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow,
+				Util::file_time(ffd.ftLastWriteTime),
+				(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+				(ffd.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0 });
+		} while (FindNextFile(hfind, &ffd) != 0);
+		FindClose(hfind);
+		return true;
+	}
+};
+
+// The cache file of one stack with its icons. Format, scan and index are in CacheCore.
+struct Cache : CacheCore {
+
+	IconAtlas           atlas;
+	int                 fixed_items;
+	bool                was_rebuilt;
+	bool                damaged;        // a submenu's records failed validation, the file needs a rebuild
+
+	// Label extents per item in pixels for RenderContext::layout `text_layout`, -1 until measured. They
+	// live with the cache so a resident host measures each label once, not on every open.
+	std::vector<int>    text_widths;
+	U32                 text_layout;
+
+	Cache(const String& stack_path) : CacheCore(stack_path), was_rebuilt(false), damaged(false), fixed_items(0), text_layout(0), icon_count(0), index_valid(false) {
+		cache_path = path(CACHE_FILE_NAME);
+		// Until the menu says otherwise, the size for the monitor under the cursor, where the menu opens
+		POINT pt = { 0, 0 };
+		::GetCursorPos(&pt);
+		size_index = icon_size_index(MulDiv(16, Util::monitor_dpi(pt), 96));
+	}
+
+	bool scan() {
+		Trace::Phase phase("scan");
+		Win32FileSystem fs;
+		if (!CacheCore::scan(fs)) {
+			return false;
+		}
+		Trace::add(Trace::ITEMS_SCANNED, scanned_count());
+		return true;
+	}
+
+	// Requires scan(). Only the root folder is decoded here, submenus are decoded by load_group() when they are first opened.
+	// `repair` rebuilds even an up-to-date file, after a submenu of it turned out damaged.
+	bool load(bool repair = false) {
+		Trace::Phase phase("load");
+		if (!open() || is_outdated() || repair || !load_group(0)) {
+			// Missing, invalid or outdated cache, or the stack folder changed
+			rebuild();
+			was_rebuilt = true;
+		}
+		return true;
+	}
+
+	// Loads whatever valid cache the last run left, without scanning the stack folder
+	bool load_cached() {
+		Trace::Phase phase("load_cached");
+		return open() && load_group(0);
+	}
+
+	// Decodes the records of one folder on first use
+	bool load_group(DWORD group) {
+		if (group >= groups.size()) {
+			return false;
+		}
+		if (group_loaded[group]) {
+			return true;
+		}
+		group_loaded[group] = true;
+		Trace::Phase phase("load_group");
+		Trace::add(Trace::GROUPS_DECODED, 1);
+
+		size_t bytes_read = 0;
+		bool decoded = decode_group(cache_file, group, bytes_read);
+		Trace::add(Trace::CACHE_BYTES_READ, bytes_read);
+		if (!decoded) {
+			// Corrupt or truncated: the level shows what decoded, the next load rebuilds the file
+			damaged = true;
+			return false;
+		}
+		const Group& g = groups[group];
+		for (DWORD i = g.first; i < g.first + g.count; i++) {
+			int& slot = slots[entries[i].item];
+			if (!load_icon(slot)) {
+				slot = -1;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Switches the atlas to the stored size for `icon_size` pixel icons, e.g. for a menu on a monitor with
+	// another DPI. Decoded groups get their icons copied again, the others when they are decoded.
+	void set_icon_size(int icon_size) {
+		size_t index = icon_size_index(icon_size);
+		if (index == size_index || !cache_file.data || !atlas.create(icon_loaded.size(), ICON_SIZES[index])) {
+			return;
+		}
+		size_index = index;
+		icon_loaded.assign(icon_loaded.size(), false);
+		for (size_t g = 0; g < groups.size(); g++) {
+			if (!group_loaded[g]) continue;
+			for (U32 i = groups[g].first; i < groups[g].first + groups[g].count; i++) {
+				load_icon(slots[entries[i].item]);
+			}
+		}
+	}
+
+private:
+	// Target of a .lnk or .url, resolved once by the rebuild so a click can launch it directly
+	struct Launch {
+		String      target;
+		String      arguments;
+		String      work_dir;
+		U32         show_cmd;
+	};
+	enum { MAX_EXTRACT_WORKERS = 8, EXTRACT_JOBS_PER_WORKER = 8, EXTRACT_BATCH = 256 };
+	enum { MAX_URL_LENGTH = 2084 };     // INTERNET_MAX_URL_LENGTH, without wininet.h
+	enum { SAVE_ATTEMPTS = 3, SAVE_RETRY_DELAY = 50 };
+
+	String      cache_path;
+	MappedFile  cache_file;
+	bool        index_valid;    // cache_file holds a complete index of the current format
+	// Records of the previous cache file by name, whose icons a rebuild reuses when the entry did not change.
+	// They point into the old mapping, which stays open until the rebuild has copied their targets.
+	std::unordered_map<StringView, Record> reusable;
+	std::vector<bool> icon_loaded;
+	size_t      size_index;     // ICON_SIZES entry the atlas holds
+	int         icon_count;     // distinct icons, rebuild only
+	std::vector<Byte> icon_sets;                // distinct icons in all sizes, rebuild only
+	std::unordered_map<Hash, int> icon_slots;   // content hash -> icon, rebuild only
+
+	// Maps the cache file and reads the index if it has the current format
+	bool open() {
+		index_valid = false;
+
+		Header header = { 0 };
+		if (!cache_file.open(cache_path) || !read_index(cache_file, header)) {
+			return false;
+		}
+		Trace::add(Trace::CACHE_BYTES_READ, icons_pos);
+		// One atlas slot per distinct icon; slots are filled as groups get decoded
+		if (!atlas.create(header.icon_count, ICON_SIZES[size_index])) {
+			return false;
+		}
+		icon_loaded.assign(header.icon_count, false);
+		index_valid = true;
+		return true;
+	}
+
+	// Collects the icons of the current cache file that a rebuild can copy instead of extracting again
+	void collect_reusable() {
+		reusable.clear();
+		if (!index_valid) {
+			return;
+		}
+		for (const Entry& e : entries) {
+			Record old;
+			size_t pos = e.offset;
+			if (read_record(cache_file, pos, (U32)groups.size(), old) && old.icon < icon_loaded.size()) {
+				reusable[old.name] = old;
+			}
+		}
+	}
+
+	// Decodes an icon from the mapping into its atlas slot the first time an item needs it
+	bool load_icon(int icon) {
+		if (icon < 0 || (size_t)icon >= icon_loaded.size() || !atlas.has_slot(icon)) {
+			return false;
+		}
+		if (!icon_loaded[icon]) {
+			icon_loaded[icon] = true;
+			// Decoded in place: the mapping's bytes are the only copy on the way to the DIB section
+			size_t bytes_read = 0;
+			if (!read_icon(cache_file, size_index, icon, atlas.begin_write(icon), atlas.stride(), bytes_read)) {
+				atlas.clear(icon);
+				return false;
+			}
+			Trace::add(Trace::CACHE_BYTES_READ, bytes_read);
+		}
+		return true;
+	}
+
+	// Only new or modified entries go through the shell; unchanged ones copy their icons from the old file
+	bool rebuild() {
+		Trace::Phase phase("rebuild");
+		Buffer buffer;
+		collect_reusable();
+
+		add_scanned_items();
+		icon_count = 0;
+		icon_slots.clear();
+		icon_sets.clear();
+
+		std::vector<const Record*> reused(item_count(), nullptr);
+		for (size_t i = 0; i < item_count(); i++) {
+			auto old = reusable.find(name(i));
+			if (old != reusable.end() && old->second.stamp.size == stamps[i].size && old->second.stamp.write_time == stamps[i].write_time) {
+				flags[i] = (Byte)(old->second.flags & FLAG_SUBMENU);
+				reused[i] = &old->second;
+			}
+		}
+
+		// Extract the rest concurrently, a batch at a time to bound the memory of the icon sets, then merge
+		// in scan order so the output does not depend on timing
+		const size_t set_bytes = icon_set_bytes();
+		std::vector<Byte> icons;
+		std::vector<Launch> resolved;
+		std::vector<size_t> jobs;
+		for (size_t first = 0; first < item_count(); first += EXTRACT_BATCH) {
+			size_t last = min(item_count(), first + EXTRACT_BATCH);
+			icons.assign((last - first) * set_bytes, 0);
+			resolved.assign(last - first, Launch{});
+			jobs.clear();
+			for (size_t i = first; i < last; i++) {
+				if (reused[i] && !read_icon_set(reused[i]->icon, icons.data() + (i - first) * set_bytes)) {
+					reused[i] = nullptr;
+				}
+				if (!reused[i]) jobs.push_back(i);
+			}
+			// Counted once a reuse that failed to read has fallen back to extraction
+			Trace::add(Trace::ICONS_EXTRACTED, jobs.size());
+			Trace::add(Trace::ICONS_REUSED, last - first - jobs.size());
+			extract_icons(jobs, first, icons.data(), resolved.data());
+			for (size_t i = first; i < last; i++) {
+				add_icon(i, icons.data() + (i - first) * set_bytes);
+				if (reused[i]) {
+					const Record& r = *reused[i];
+					set_target(i, r.target, r.arguments, r.work_dir, r.show_cmd);
+				}
+				else {
+					const Launch& l = resolved[i - first];
+					set_target(i, l.target, l.arguments, l.work_dir, l.show_cmd);
+				}
+			}
+		}
+		icon_slots.clear();
+		reusable.clear();
+		IconStore::trim();
+		build_index();
+
+		serialize(buffer, icon_count, [&](size_t s, U32 icon) {
+			return icon_sets.data() + icon * set_bytes + icon_set_offset(s);
+		});
+		atlas.create(icon_count, ICON_SIZES[size_index]);
+		for (int icon = 0; icon < icon_count; icon++) {
+			atlas.write(icon, icon_sets.data() + icon * set_bytes + icon_set_offset(size_index));
+		}
+		icon_loaded.assign(icon_count, true);
+		icon_sets = std::vector<Byte>();
+
+		// New items only reference string_pool, release the old mapping so the file can be replaced
+		cache_file.close();
+		index_valid = false;
+		size_t file_size = buffer.size;
+		save(buffer);
+		buffer.free();
+
+		// The new file is mapped again so set_icon_size() can switch to its other sizes
+		if (!cache_file.open(cache_path) || cache_file.size != file_size) {
+			cache_file.close();
+		}
+		return true;
+	}
+	// All sizes of an icon of the current cache file, for a rebuild to reuse
+	bool read_icon_set(int icon, Byte* icon_set) {
+		size_t bytes_read = 0;
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			if (!read_icon(cache_file, s, icon, icon_set + icon_set_offset(s), 0, bytes_read)) {
+				return false;
+			}
+		}
+		Trace::add(Trace::CACHE_BYTES_READ, bytes_read);
+		return true;
+	}
+	// Runs create_item for the given items on a small worker pool. The icon set of item i goes to
+	// batch_sets + (i - first) * icon_set_bytes(), its resolved target to launches[i - first].
+	void extract_icons(const std::vector<size_t>& jobs, size_t first, Byte* batch_sets, Launch* launches) {
+		if (jobs.empty()) {
+			return;
+		}
+		Trace::Phase phase("extract_icons");
+		const size_t set_bytes = icon_set_bytes();
+		std::atomic<size_t> next(0);
+		auto work = [&]() {
+			IconExtractor extractor;
+			String file_path;
+			for (size_t j; (j = next++) < jobs.size(); ) {
+				create_item(path(jobs[j] ? name(jobs[j]) : StringView(), file_path), extractor, batch_sets + (jobs[j] - first) * set_bytes, launches[jobs[j] - first], flags[jobs[j]]);
+			}
+		};
+
+		unsigned workers = min(max(std::thread::hardware_concurrency(), 1u), (unsigned)MAX_EXTRACT_WORKERS);
+		workers = min(workers, (unsigned)((jobs.size() + EXTRACT_JOBS_PER_WORKER - 1) / EXTRACT_JOBS_PER_WORKER));
+		if (workers <= 1) {
+			// Not worth a thread. The IconExtractor in work() initializes COM on the calling thread too.
+			work();
+			return;
+		}
+		std::vector<std::thread> pool;
+		for (unsigned w = 0; w < workers; w++) {
+			pool.emplace_back(work);
+		}
+		for (auto& t : pool) t.join();
+	}
+	// Safe to call from extraction workers: it only touches this item's flags and its own pixel buffer
+	static bool create_item(const String& file_path, IconExtractor& extractor, Byte* icon_set, Launch& launch, Byte& item_flags) {
+		item_flags = 0;
+
+		DWORD attrs = ::GetFileAttributes(file_path.c_str());
+		if (attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+			resolve_target(file_path, launch);
+		}
+		if (attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+
+			// Mark as submenu if needed
+			if (Util::ends_with(file_path, SUBMENU_SUFFIX)) {
+				item_flags = FLAG_SUBMENU;
+			}
+
+			// For ANY folder: try custom icon from desktop.ini first, then the normal folder icon
+			String icon_path = Util::ReadIconFromDesktopIni(file_path);
+			if (!icon_path.empty() && extractor.convert_icon_resource(icon_path, icon_set)) {
+				return true;
+			}
+		}
+
+		// Icons shared by other stacks are read from the store instead of the shell
+		Hash key = IconStore::on() ? IconStore::key(file_path) : 0;
+		if (key && IconStore::find(key, icon_set)) {
+			return true;
+		}
+		if (!extractor.convert_file_icon(file_path, icon_set)) {
+			return false;
+		}
+		if (key) IconStore::add(key, icon_set);
+		return true;
+	}
+	// Reads what a .lnk or .url opens, without UI or a disk search for a missing target. Shortcuts that need
+	// more than target, arguments and folder (run as administrator, installer-advertised, no file target)
+	// are left to the shell.
+	static void resolve_target(const String& file_path, Launch& launch) {
+		String lower = file_path;
+		::CharLowerBuff(&lower[0], (DWORD)lower.size());
+		if (Util::ends_with(lower, L".url")) {
+			Char url[MAX_URL_LENGTH] = { 0 };
+			::GetPrivateProfileString(L"InternetShortcut", L"URL", L"", url, _countof(url), file_path.c_str());
+			launch.target = url;
+			launch.show_cmd = SW_NORMAL;
+			return;
+		}
+		if (!Util::ends_with(lower, L".lnk")) {
+			return;
+		}
+		IShellLink* link = 0;
+		IPersistFile* file = 0;
+		IShellLinkDataList* data = 0;
+		if (FAILED(::CoCreateInstance(CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER, IID_IShellLink, (LPVOID*)&link))) {
+			return;
+		}
+		DWORD flags = 0;
+		if (SUCCEEDED(link->QueryInterface(IID_IShellLinkDataList, (void**)&data))) {
+			if (SUCCEEDED(link->QueryInterface(IID_IPersistFile, (void**)&file)) && SUCCEEDED(file->Load(file_path.c_str(), STGM_READ)) &&
+				SUCCEEDED(data->GetFlags(&flags)) && !(flags & (SLDF_RUNAS_USER | SLDF_HAS_DARWINID)) &&
+				SUCCEEDED(link->Resolve(0, SLR_NO_UI | SLR_NOSEARCH | SLR_NOTRACK | SLR_NOUPDATE))) {
+				Char target[MAX_PATH] = { 0 }, arguments[INFOTIPSIZE] = { 0 }, work_dir[MAX_PATH] = { 0 };
+				int show_cmd = SW_NORMAL;
+				if (link->GetPath(target, MAX_PATH, nullptr, 0) == S_OK && target[0]) {
+					link->GetArguments(arguments, INFOTIPSIZE);
+					link->GetWorkingDirectory(work_dir, MAX_PATH);
+					link->GetShowCmd(&show_cmd);
+					launch = Launch{ target, arguments, work_dir, (U32)show_cmd };
+				}
+			}
+			if (file) file->Release();
+			data->Release();
+		}
+		link->Release();
+	}
+	// Keeps the icon set unless an identical one is stored already
+	void add_icon(size_t item, const Byte* icon_set) {
+		const size_t set_bytes = icon_set_bytes();
+		Util::Hasher hasher;
+		hasher.add(icon_set, set_bytes);
+		Hash hash = hasher.value();
+		auto it = icon_slots.find(hash);
+		if (it != icon_slots.end() && !memcmp(icon_sets.data() + it->second * set_bytes, icon_set, set_bytes)) {
+			slots[item] = it->second;
+			return;
+		}
+		if (it == icon_slots.end()) {
+			icon_slots[hash] = icon_count;
+		}
+		icon_sets.insert(icon_sets.end(), icon_set, icon_set + set_bytes);
+		slots[item] = icon_count++;
+	}
+
+	// The old file may still be mapped by a stacky showing it, which blocks deleting or overwriting it
+	// but not renaming it. So the new file is written aside and swapped in by two renames. A failed
+	// save leaves the previous file in place and shows as a save_failed mark in the trace.
+	bool save(Buffer& buffer) {
+		Trace::Phase phase("save");
+		String tmp_path = cache_path + L".tmp";
+		String old_path = cache_path + L".old";
+		// Hidden from the start, so a stacky killed before the swap leaves nothing a scan would list
+		HANDLE file = ::CreateFile(tmp_path.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN, 0);
+		if (file == INVALID_HANDLE_VALUE) {
+			Trace::mark("save_failed");
+			return false;
+		}
+		DWORD written = 0;
+		bool saved = ::WriteFile(file, buffer.data, (DWORD)buffer.size, &written, 0) && written == buffer.size;
+		::CloseHandle(file);
+		if (saved) {
+			Trace::add(Trace::CACHE_BYTES_WRITTEN, buffer.size);
+			saved = swap_in(tmp_path, old_path);
+		}
+		if (!saved) {
+			::DeleteFile(tmp_path.c_str());
+			Trace::mark("save_failed");
+		}
+		return saved;
+	}
+	// The .old file of the previous save goes first. It cannot be replaced while a stacky still shows it,
+	// which mostly is one that kill_other_stackies() just terminated, so the swap is retried briefly.
+	bool swap_in(const String& tmp_path, const String& old_path) {
+		for (int attempt = 0; attempt < SAVE_ATTEMPTS; attempt++) {
+			if (attempt) ::Sleep(SAVE_RETRY_DELAY);
+			::DeleteFile(old_path.c_str());
+			bool moved = ::MoveFileEx(cache_path.c_str(), old_path.c_str(), MOVEFILE_REPLACE_EXISTING) || ::GetLastError() == ERROR_FILE_NOT_FOUND;
+			if (moved && ::MoveFileEx(tmp_path.c_str(), cache_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+				// Fails while the old file is mapped, the next save deletes it then
+				::DeleteFile(old_path.c_str());
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Allocated in App::session with its text, both live until the menu closes
+struct MenuEntry {
+	U32 item;              // cache item (folder or file)
+	StringView text;       // display text, null-terminated
+	bool is_submenu;
+	bool populated;        // for lazy submenus
+	DWORD group;           // cache group with the submenu's children
+	bool is_path = false;
+	bool is_list = false;  // a folder with more than LIST_THRESHOLD items, it opens a ListPopup when chosen
+	int text_width = 0;    // label extent in pixels, from Cache::text_widths
+};
+
+/**************************************************************************************************
+ * Render context
+ **************************************************************************************************/
+// GDI objects, metrics and theme colors for owner-drawn menus. They are built once per DPI and theme
+// and reused by every WM_MEASUREITEM / WM_DRAWITEM; invalidate() drops them after a settings change.
+// Items are painted into a back buffer and copied with one blit, so hovering does not flicker.
+struct RenderContext {
+	UINT        dpi;
+	U32         layout;         // changes with the font, keys Cache::text_widths
+	int         icon;           // icon size
+	int         pad;            // item padding
+	int         separator;      // separator height
+	int         line_pad;       // separator line inset
+	HFONT       font;
+	COLORREF    fg, disabled_fg, selected_fg;
+	HBRUSH      bg_brush, selected_brush;
+	HPEN        line_pen;
+
+	RenderContext() : dpi(0), layout(0), icon(16), pad(12), separator(6), line_pad(2), font(0), fg(0), disabled_fg(0), selected_fg(0),
+		bg_brush(0), selected_brush(0), line_pen(0), dark(false), buffer_dc(0), buffer(0), buffer_size{} {}
+	~RenderContext() {
+		invalidate();
+	}
+
+	// At the start of every menu: rebuilds what the DPI of the monitor at `pt` or the theme made stale.
+	// Not the owner window's DPI, that window sits at (0,0), possibly on another monitor.
+	void prepare(POINT pt, bool dark_mode) {
+		UINT now = Util::monitor_dpi(pt);
+		if (!font || now != dpi) {
+			release_buffer();
+			release_font();
+			dpi = now;
+			create_font();
+		}
+		if (!bg_brush || dark_mode != dark) {
+			release_colors();
+			dark = dark_mode;
+			create_colors();
+		}
+	}
+
+	// WM_DPICHANGED / WM_SETTINGCHANGE: the next prepare() starts over
+	void invalidate() {
+		release_buffer();
+		release_font();
+		release_colors();
+	}
+
+	// Returns the DC to paint `rc` into: the back buffer with `rc` moved to its origin, or `target` when there is none
+	HDC begin(HDC target, RECT& rc) {
+		int w = rc.right - rc.left, h = rc.bottom - rc.top;
+		if (w > buffer_size.cx || h > buffer_size.cy) {
+			release_buffer();
+			SIZE size = { max(w, (int)buffer_size.cx), max(h, (int)buffer_size.cy) };
+			buffer_dc = CreateCompatibleDC(target);
+			buffer = buffer_dc ? CreateCompatibleBitmap(target, size.cx, size.cy) : 0;
+			if (!buffer) {
+				release_buffer();
+				return target;
+			}
+			buffer_size = size;
+			SelectObject(buffer_dc, buffer);
+			SelectObject(buffer_dc, font);
+			SetBkMode(buffer_dc, TRANSPARENT);
+		}
+		rc = { 0, 0, w, h };
+		return buffer_dc;
+	}
+
+	// Copies what begin() buffered to `item` on the target
+	void end(HDC target, const RECT& item, HDC dc) {
+		if (dc == target) return;
+		BitBlt(target, item.left, item.top, item.right - item.left, item.bottom - item.top, dc, 0, 0, SRCCOPY);
+	}
+
+private:
+	bool        dark;
+	HDC         buffer_dc;
+	HBITMAP     buffer;
+	SIZE        buffer_size;
+
+	// The menu font for the DPI, used to measure and to draw so both agree
+	void create_font() {
+		NONCLIENTMETRICS ncm{ sizeof(ncm) };
+		if (SystemParametersInfoForDpi(SPI_GETNONCLIENTMETRICS, sizeof(ncm), &ncm, 0, dpi)) {
+			font = CreateFontIndirect(&ncm.lfMenuFont);
+		}
+		if (!font) font = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+		// a stored size, so icons are drawn 1:1
+		icon = ICON_SIZES[CacheCore::icon_size_index(MulDiv(16, dpi, 96))];
+		pad = MulDiv(12, dpi, 96);
+		separator = MulDiv(6, dpi, 96);  // slim separator
+		line_pad = MulDiv(2, dpi, 96);
+		layout++;
+	}
+
+	void create_colors() {
+		fg = dark ? RGB(240, 240, 240) : GetSysColor(COLOR_MENUTEXT);
+		disabled_fg = dark ? RGB(140, 140, 140) : GetSysColor(COLOR_GRAYTEXT);
+		// Selection colors (avoid the bright default blue in dark mode)
+		selected_fg = dark ? RGB(255, 255, 255) : GetSysColor(COLOR_HIGHLIGHTTEXT);
+		bg_brush = CreateSolidBrush(dark ? RGB(32, 32, 32) : GetSysColor(COLOR_MENU));
+		selected_brush = CreateSolidBrush(dark ? RGB(64, 64, 64) : GetSysColor(COLOR_HIGHLIGHT));
+		line_pen = CreatePen(PS_SOLID, 1, dark ? RGB(70, 70, 70) : GetSysColor(COLOR_3DSHADOW));
+	}
+
+	void release_font() {
+		if (font) DeleteObject(font);
+		font = 0;
+	}
+	void release_colors() {
+		if (bg_brush) DeleteObject(bg_brush);
+		if (selected_brush) DeleteObject(selected_brush);
+		if (line_pen) DeleteObject(line_pen);
+		bg_brush = selected_brush = 0;
+		line_pen = 0;
+	}
+	// The DC goes first, it has the bitmap and the font selected
+	void release_buffer() {
+		if (buffer_dc) DeleteDC(buffer_dc);
+		if (buffer) DeleteObject(buffer);
+		buffer_dc = 0;
+		buffer = 0;
+		buffer_size = {};
+	}
+};
+
+/**************************************************************************************************
+ * List popup: a menu drawn by stacky itself. Used for folders too large for a native menu, which
+ * would measure and lay out every item before showing, and for every menu with --custom-menu.
+ * Only the rows in view are measured and painted, a hover change repaints the two rows involved,
+ * and rows are addressed by cache item index. Submenus cascade into child lists like native menus;
+ * Esc, Left or Backspace goes back to the parent level.
+ **************************************************************************************************/
+struct ListPopup {
+	enum Result { CLOSED, CHOSEN, TYPED, BACK };
+	enum Flags {
+		CAPTION = 1,    // the header is a disabled line (the type-to-filter query), not the base folder item
+		SUBMENU = 2,    // a submenu level: going back returns BACK instead of closing the menu
+	};
+
+	// `opened_submenu` is set when a child level opens, a live refresh then leaves the menu alone
+	ListPopup(Cache& c, RenderContext& r, bool dark_mode, bool& opened_submenu, ListPopup* parent_list = nullptr) : cache(c), render(r),
+		dark(dark_mode), submenu_opened(opened_submenu), parent(parent_list), child(nullptr), owner(0), hwnd(0), flags(0), row_height(1), scroll(0),
+		selected(-1), child_row(-1), hover_delay(400), tracking_leave(false), done(false), result(CLOSED), chosen(0), typed(0), back_to(0) {}
+
+	// Modal like TrackPopupMenuEx: shows `nodes` next to `anchor` (a point, a parent's row or a native menu
+	// item) until an item is chosen, a character is typed (for type-to-filter) or the list is dismissed.
+	// A `header` row above the nodes chooses item 0 unless `flags` has CAPTION.
+	Result track(HWND owner_window, const std::vector<MenuNode>& nodes, const RECT& anchor, StringView header_text, U32 list_flags, U32& item, Char& typed_char) {
+		owner = owner_window;
+		header = header_text;
+		flags = parent ? list_flags | SUBMENU : list_flags;
+		row_height = max(GetSystemMetrics(SM_CYMENU), render.icon + render.pad / 2);
+		SystemParametersInfo(SPI_GETMENUSHOWDELAY, 0, &hover_delay, 0);
+		fill(nodes);
+		RECT rc = layout(anchor);
+
+		// Dark menus get a border instead of the system shadow, which is always light
+		const Char* class_name = dark ? LIST_CLASS_DARK : LIST_CLASS;
+		WNDCLASS wc{ 0 };
+		wc.style = dark ? 0 : CS_DROPSHADOW;
+		wc.lpfnWndProc = window_proc;
+		wc.hInstance = GetModuleHandle(nullptr);
+		wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+		wc.lpszClassName = class_name;
+		RegisterClass(&wc);     // fails harmlessly once registered
+		// Owned by the parent level, which gets the activation back when this one closes
+		hwnd = CreateWindowEx(WS_EX_TOOLWINDOW | WS_EX_TOPMOST, class_name, L"", WS_POPUP,
+			rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, parent ? parent->hwnd : owner, nullptr, wc.hInstance, this);
+		if (!hwnd) {
+			return CLOSED;
+		}
+		ShowWindow(hwnd, SW_SHOW);
+		SetForegroundWindow(hwnd);
+
+		MSG msg;
+		while (!done) {
+			if (GetMessage(&msg, nullptr, 0, 0) <= 0) {
+				// Leave WM_QUIT to the app's own loop
+				PostQuitMessage((int)msg.wParam);
+				break;
+			}
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+		done = true;
+		DestroyWindow(hwnd);
+		hwnd = 0;
+		item = chosen;
+		typed_char = typed;
+		return result;
+	}
+
+	// The level of `group`, decoded on first use
+	Result track(HWND owner_window, U32 group, const RECT& anchor, StringView header_text, U32 list_flags, U32& item, Char& typed_char) {
+		cache.load_group(group);
+		std::vector<MenuNode> nodes;
+		MenuTree::build_level(cache, group, nodes);
+		return track(owner_window, nodes, anchor, header_text, list_flags, item, typed_char);
+	}
+
+	// From the app while tracking, e.g. another stack was clicked. Closes the open child levels too.
+	void close() {
+		if (child) child->close();
+		finish(CLOSED);
+	}
+
+private:
+	static constexpr const Char* LIST_CLASS = L"stacky list";
+	static constexpr const Char* LIST_CLASS_DARK = L"stacky list dark";
+	enum { HOVER_TIMER = 1 };
+
+	Cache&              cache;
+	RenderContext&      render;
+	bool                dark;
+	bool&               submenu_opened;
+	ListPopup*          parent;
+	ListPopup*          child;      // while a submenu of this level is tracked
+	HWND                owner;      // the app window, for measuring
+	HWND                hwnd;
+	U32                 flags;
+	StringView          header;
+	std::vector<MenuNode> rows;
+	std::vector<int>    tops;       // y of each row in the list, and the list height at the end
+	int                 row_height;
+	int                 scroll;     // in pixels, so wheels and touchpads scroll smoothly
+	int                 selected;
+	int                 child_row;      // the row whose submenu is open
+	DWORD               hover_delay;    // the menu show delay: hovering a row this long opens its submenu
+	bool                tracking_leave; // WM_MOUSELEAVE was asked for
+	bool                done;
+	Result              result;
+	U32                 chosen;
+	Char                typed;
+	HWND                back_to;    // with BACK: the level whose click deactivated this one, 0 for a key
+
+	// The header, if any, and its separator come first
+	void fill(const std::vector<MenuNode>& nodes) {
+		rows.clear();
+		if (!header.empty()) {
+			rows.push_back(MenuNode{ 0, header, false, false, 0 });
+			if (!nodes.empty()) rows.push_back(MenuNode{ 0, StringView(), true, false, 0 });
+		}
+		rows.insert(rows.end(), nodes.begin(), nodes.end());
+
+		// Row positions are plain sums, nothing is measured here
+		tops.resize(rows.size() + 1);
+		tops[0] = 0;
+		for (size_t r = 0; r < rows.size(); r++) {
+			tops[r + 1] = tops[r] + (rows[r].is_separator ? render.separator : row_height);
+		}
+	}
+	bool is_header(int row) const {
+		return row == 0 && !header.empty();
+	}
+	bool is_caption(int row) const {
+		return is_header(row) && (flags & CAPTION);
+	}
+	bool selectable(int row) const {
+		return row >= 0 && row < (int)rows.size() && !rows[row].is_separator && !is_caption(row);
+	}
+	bool is_ancestor(HWND window) const {
+		for (ListPopup* p = parent; p; p = p->parent) {
+			if (window && p->hwnd == window) return true;
+		}
+		return false;
+	}
+
+	// Window rect: as much of the list as fits in 80% of the work area, as wide as the labels of the first
+	// screen. It opens to the right of `anchor`, or to its left when there is no room, and moves up to fit
+	// like a native menu. A point anchor opens at the point.
+	RECT layout(const RECT& anchor) {
+		POINT pt = { anchor.right, anchor.top };
+		RECT wa = Util::GetWorkAreaForMonitor(MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST));
+		int h = max(min(tops.back(), (int)(wa.bottom - wa.top) * 4 / 5), row_height);
+
+		int text = 0;
+		HDC hdc = GetDC(owner);
+		HFONT old = (HFONT)SelectObject(hdc, render.font);
+		for (int r = 0; r < (int)rows.size() && tops[r] < h; r++) {
+			SIZE ts{};
+			GetTextExtentPoint32(hdc, rows[r].text.data(), (int)rows[r].text.size(), &ts);
+			text = max(text, (int)ts.cx);
+		}
+		SelectObject(hdc, old);
+		ReleaseDC(owner, hdc);
+
+		int w = render.icon + render.pad + text + 2 * render.pad;
+		w = min(max(w, MulDiv(200, render.dpi, 96)), (int)((wa.right - wa.left) * 0.4));
+		RECT rc = { pt.x, pt.y, pt.x + w, pt.y + h };
+		if (rc.right > wa.right) OffsetRect(&rc, max(wa.left, anchor.left - w) - rc.left, 0);
+		if (rc.bottom > wa.bottom) OffsetRect(&rc, 0, max(wa.top, min(anchor.bottom, wa.bottom) - h) - rc.top);
+		return rc;
+	}
+
+	int client_height() const {
+		RECT rc;
+		GetClientRect(hwnd, &rc);
+		return rc.bottom - rc.top;
+	}
+	int client_width() const {
+		RECT rc;
+		GetClientRect(hwnd, &rc);
+		return rc.right - rc.left;
+	}
+	int max_scroll() const {
+		return max(0, tops.back() - client_height());
+	}
+	// The row under client `y`, or -1
+	int row_at(int y) const {
+		if (y < 0 || y + scroll >= tops.back()) return -1;
+		return (int)(std::upper_bound(tops.begin(), tops.end(), y + scroll) - tops.begin()) - 1;
+	}
+	// The next row from `row` in direction `delta` that can be selected, `row` itself when there is none
+	int step(int row, int delta) const {
+		for (int r = row + delta; r >= 0 && r < (int)rows.size(); r += delta) {
+			if (selectable(r)) return r;
+		}
+		return row;
+	}
+	// A row in screen coordinates, where its submenu cascades from
+	RECT row_rect(int row) const {
+		POINT tl = { 0, tops[row] - scroll }, br = { client_width(), tops[row + 1] - scroll };
+		ClientToScreen(hwnd, &tl);
+		ClientToScreen(hwnd, &br);
+		return RECT{ tl.x, tl.y, br.x, br.y };
+	}
+
+	void invalidate_row(int row) {
+		if (!hwnd || row < 0 || row >= (int)rows.size()) return;
+		RECT rc = { 0, tops[row] - scroll, client_width(), tops[row + 1] - scroll };
+		InvalidateRect(hwnd, &rc, FALSE);
+	}
+	void scroll_to(int y) {
+		y = min(max(y, 0), max_scroll());
+		if (y == scroll) return;
+		// The rows in view all move, there is nothing to keep
+		scroll = y;
+		InvalidateRect(hwnd, nullptr, FALSE);
+	}
+	void select(int row, bool reveal) {
+		if (!selectable(row)) return;
+		if (reveal) {
+			if (tops[row] < scroll) scroll_to(tops[row]);
+			else if (tops[row + 1] > scroll + client_height()) scroll_to(tops[row + 1] - client_height());
+		}
+		if (row == selected) return;
+		invalidate_row(selected);
+		selected = row;
+		invalidate_row(selected);
+		notify_selection();
+	}
+	void deselect() {
+		if (selected < 0) return;
+		invalidate_row(selected);
+		selected = -1;
+		notify_selection();
+	}
+	// Tells the app which item is highlighted, like WM_MENUSELECT does for native menus, so it gets the
+	// same prefetch dwell. Folders and the header are not programs and count as none.
+	void notify_selection() {
+		bool program = selectable(selected) && !rows[selected].is_submenu && !is_header(selected);
+		SendMessage(owner, WM_LIST_SELECT, program ? rows[selected].item : 0, 0);
+	}
+	// Keyboard paging: the row about a screen away, on a selectable one
+	void page(int delta) {
+		int target = selected < 0 ? 0 : row_at(tops[selected] - scroll + delta * (client_height() - row_height));
+		if (target < 0) target = delta < 0 ? 0 : (int)rows.size() - 1;
+		if (!selectable(target)) target = step(target, delta) != target ? step(target, delta) : step(target, -delta);
+		select(target, true);
+	}
+
+	void activate(int row) {
+		if (!selectable(row)) return;
+		const MenuNode& node = rows[row];
+		if (!node.is_submenu || is_header(row)) {
+			chosen = node.item;
+			finish(CHOSEN);
+			return;
+		}
+		// The child runs its own loop; this level stays open behind it
+		submenu_opened = true;
+		ListPopup level(cache, render, dark, submenu_opened, this);
+		child = &level;
+		child_row = row;
+		Result r = level.track(owner, node.group, row_rect(row), StringView(), 0, chosen, typed);
+		child = nullptr;
+		child_row = -1;
+		if (r != BACK) {
+			finish(r);
+		}
+		else if (level.back_to && level.back_to != hwnd) {
+			// A click on a level further up
+			back_to = level.back_to;
+			finish(BACK);
+		}
+		else if (!done) {
+			SetForegroundWindow(hwnd);
+		}
+	}
+	void go_back() {
+		back_to = 0;
+		finish((flags & SUBMENU) ? BACK : CLOSED);
+	}
+	// Closes this level and the ones it opened, back to the level `to` further up
+	void back(HWND to) {
+		if (child) child->back(to);
+		back_to = to;
+		finish(BACK);
+	}
+	// The mouse rested on a row for the menu show delay: it replaces an open submenu, and opens its own
+	void on_hover() {
+		if (!selectable(selected) || selected == child_row) return;
+		if (child) {
+			// Its loop has to end first, the timer comes back once this level's loop runs again
+			child->back(hwnd);
+			SetTimer(hwnd, HOVER_TIMER, USER_TIMER_MINIMUM, nullptr);
+			return;
+		}
+		if (rows[selected].is_submenu && !is_header(selected)) activate(selected);
+	}
+	void finish(Result r) {
+		if (done) return;
+		done = true;
+		result = r;
+		// Wakes the loop in track() when called while it waits, e.g. from a sent message
+		if (hwnd) PostMessage(hwnd, WM_NULL, 0, 0);
+	}
+
+	void on_key(WPARAM key) {
+		switch (key) {
+		case VK_UP:     select(step(selected, -1), true); break;
+		case VK_DOWN:   select(step(selected, 1), true); break;
+		case VK_PRIOR:  page(-1); break;
+		case VK_NEXT:   page(1); break;
+		case VK_HOME:   select(step(-1, 1), true); break;
+		case VK_END:    select(step((int)rows.size(), -1), true); break;
+		case VK_RETURN: activate(selected); break;
+		case VK_RIGHT:
+			if (selected >= 0 && rows[selected].is_submenu) activate(selected);
+			break;
+		case VK_BACK:
+			// Over type-to-filter results it edits the query, like in a native menu
+			if (flags & CAPTION) {
+				typed = VK_BACK;
+				finish(TYPED);
+			}
+			else if (flags & SUBMENU) {
+				go_back();
+			}
+			break;
+		case VK_LEFT:
+		case VK_ESCAPE: go_back(); break;
+		}
+	}
+
+	// Repaints the update region only: after a hover change that is the two rows involved
+	void paint() {
+		PAINTSTRUCT ps;
+		HDC target = BeginPaint(hwnd, &ps);
+		RECT dirty = ps.rcPaint;
+		if (IsRectEmpty(&dirty)) {
+			EndPaint(hwnd, &ps);
+			return;
+		}
+		RECT rc = dirty;
+		HDC dc = render.begin(target, rc);
+		// The buffer holds the dirty rect at its origin
+		int dx = -dirty.left, dy = -dirty.top;
+		SelectObject(dc, render.font);
+		SetBkMode(dc, TRANSPARENT);
+		if (dc == target) dx = dy = 0;
+		RECT fill = { dirty.left + dx, dirty.top + dy, dirty.right + dx, dirty.bottom + dy };
+		FillRect(dc, &fill, render.bg_brush);
+
+		int width = client_width();
+		int first = max(row_at(dirty.top), 0);
+		for (int r = first; r < (int)rows.size() && tops[r] - scroll < dirty.bottom; r++) {
+			draw_row(dc, r, RECT{ dx, tops[r] - scroll + dy, width + dx, tops[r + 1] - scroll + dy });
+		}
+		// Thumb on the right edge when the rows do not fit
+		int height = client_height();
+		if (tops.back() > height) {
+			int thumb = max(height * height / tops.back(), row_height / 2);
+			int top = (int)((long long)scroll * (height - thumb) / (tops.back() - height));
+			RECT tr = { width - MulDiv(3, render.dpi, 96) + dx, top + dy, width + dx, top + thumb + dy };
+			FillRect(dc, &tr, render.selected_brush);
+		}
+		if (dark) {
+			HPEN old_pen = (HPEN)SelectObject(dc, render.line_pen);
+			HBRUSH old_brush = (HBRUSH)SelectObject(dc, GetStockObject(NULL_BRUSH));
+			Rectangle(dc, dx, dy, width + dx, height + dy);
+			SelectObject(dc, old_brush);
+			SelectObject(dc, old_pen);
+		}
+		render.end(target, dirty, dc);
+		EndPaint(hwnd, &ps);
+	}
+	void draw_row(HDC dc, int row, RECT rc) {
+		const MenuNode& node = rows[row];
+		if (node.is_separator) {
+			int y = (rc.top + rc.bottom) / 2;
+			HPEN old = (HPEN)SelectObject(dc, render.line_pen);
+			MoveToEx(dc, rc.left + render.line_pad, y, nullptr);
+			LineTo(dc, rc.right - render.line_pad, y);
+			SelectObject(dc, old);
+			return;
+		}
+		const bool sel = row == selected;
+		if (sel) FillRect(dc, &rc, render.selected_brush);
+		cache.atlas.draw(dc, cache.slots[node.item], rc.left + 4, rc.top + (row_height - render.icon) / 2, render.icon, is_caption(row) ? 140 : 255);
+
+		SetTextColor(dc, sel ? render.selected_fg : is_caption(row) ? render.disabled_fg : render.fg);
+		RECT tr = rc;
+		tr.left += render.icon + 8;
+		tr.right -= render.pad;
+		UINT text_flags = DT_SINGLELINE | DT_VCENTER | DT_LEFT | DT_NOPREFIX | (is_header(row) && !is_caption(row) ? DT_PATH_ELLIPSIS : DT_END_ELLIPSIS);
+		DrawText(dc, node.text.data(), (int)node.text.size(), &tr, text_flags);
+		if (node.is_submenu) {
+			RECT ar = rc;
+			ar.right -= render.pad / 2;
+			DrawText(dc, L"\u203A", 1, &ar, DT_SINGLELINE | DT_VCENTER | DT_RIGHT);
+		}
+	}
+
+	LRESULT handle(UINT msg, WPARAM wp, LPARAM lp) {
+		switch (msg) {
+		case WM_PAINT:
+			paint();
+			return 0;
+		case WM_MOUSEMOVE: {
+			if (!tracking_leave) {
+				TRACKMOUSEEVENT tme{ sizeof(tme), TME_LEAVE, hwnd, 0 };
+				tracking_leave = TrackMouseEvent(&tme) != FALSE;
+			}
+			int row = row_at((short)HIWORD(lp));
+			if (selectable(row) && row != selected) {
+				select(row, false);
+				if ((rows[row].is_submenu && !is_header(row)) || child) SetTimer(hwnd, HOVER_TIMER, hover_delay, nullptr);
+			}
+			return 0;
+		}
+		case WM_MOUSELEAVE:
+			tracking_leave = false;
+			// The row of an open submenu stays highlighted, like in a native menu
+			if (!child) deselect();
+			return 0;
+		case WM_TIMER:
+			if (wp == HOVER_TIMER) {
+				KillTimer(hwnd, HOVER_TIMER);
+				on_hover();
+				return 0;
+			}
+			break;
+		case WM_LBUTTONUP:
+			activate(row_at((short)HIWORD(lp)));
+			return 0;
+		case WM_MOUSEWHEEL:
+			scroll_to(scroll - MulDiv(GET_WHEEL_DELTA_WPARAM(wp), 3 * row_height, WHEEL_DELTA));
+			return 0;
+		case WM_KEYDOWN:
+			on_key(wp);
+			return 0;
+		case WM_CHAR:
+			if (wp >= L' ') {
+				typed = (Char)wp;
+				finish(TYPED);
+			}
+			return 0;
+		case WM_ACTIVATE:
+			// Clicking a parent level goes back to it, clicking anywhere else dismisses the menu.
+			// Opening a child level deactivates this one too, that is not a dismissal.
+			if (LOWORD(wp) == WA_INACTIVE && !child && !done) {
+				back_to = is_ancestor((HWND)lp) ? (HWND)lp : 0;
+				finish(back_to ? BACK : CLOSED);
+			}
+			break;
+		}
+		return DefWindowProc(hwnd, msg, wp, lp);
+	}
+
+	static LRESULT CALLBACK window_proc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp) {
+		if (msg == WM_NCCREATE) {
+			ListPopup* list = (ListPopup*)((CREATESTRUCT*)lp)->lpCreateParams;
+			list->hwnd = hwnd;
+			SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)list);
+		}
+		ListPopup* list = (ListPopup*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+		return list ? list->handle(msg, wp, lp) : DefWindowProc(hwnd, msg, wp, lp);
+	}
+};
+
+/**************************************************************************************************
+ * The app
+ **************************************************************************************************/
+struct App {
+
+	App(Cache* c, const String& options) : cache(c), window(0), root_menu(0), menu_open(false), submenu_opened(false), retrack(false), drawn(false), launching(0), show_next(false) {
+		set_options(options);
+		resident = options.find(L"--resident") != String::npos;
+	}
+	~App() {
+		// Let a running refresh finish writing the cache for the next open
+		if (refresher.joinable()) refresher.join();
+	}
+
+	// Show the cached menu right away and validate it in the background
+	bool refresh_in_background() const {
+		return background_refresh;
+	}
+
+	// `revalidate`: the cache was loaded without a scan, check and rebuild it on a worker thread
+	bool init(bool revalidate) {
 		Util::kill_other_stackies();
+		create_window(STACKY_WINDOW_NAME);
+
+		if (revalidate) {
+			refresher = std::thread(&App::refresh, this, cache->base_dir, nullptr, false);
+		}
+		// Exits as soon as the launch is done, or right away when the menu was dismissed.
+		// A running refresh still gets to finish, ~App waits for it.
+		U32 item = 0;
+		if (!track_menu(item) || !launch(item)) {
+			quit();
+		}
+		// A damaged submenu was opened: rebuild the cache for the next run, ~App waits for it
+		if (cache->damaged) {
+			if (refresher.joinable()) refresher.join();
+			refresher = std::thread(&App::refresh, this, cache->base_dir, nullptr, true);
+		}
+		return true;
+	}
+
+	// Resident mode: becomes the host and serves its own command line like any forwarded one
+	bool host(const String& cmd_line) {
+		create_window(STACKY_HOST_NAME);
+		return show_stack(cmd_line);
+	}
+
+	// Resident mode: hands the command line to a running host, which shows the menu instead of this process
+	static bool send_to_host(const String& cmd_line) {
+		HWND host = ::FindWindow(STACKY_WINDOW_NAME, STACKY_HOST_NAME);
+		if (!host) {
+			return false;
+		}
+		// The click made this process the foreground one, pass that on so the menu can take focus
+		DWORD host_pid = 0;
+		::GetWindowThreadProcessId(host, &host_pid);
+		::AllowSetForegroundWindow(host_pid);
+
+		COPYDATASTRUCT cds{ COPYDATA_SHOW_STACK, (DWORD)((cmd_line.size() + 1) * sizeof(Char)), (PVOID)cmd_line.c_str() };
+		DWORD_PTR handled = 0;
+		return ::SendMessageTimeout(host, WM_COPYDATA, 0, (LPARAM)&cds, SMTO_ABORTIFHUNG, HOST_TIMEOUT, &handled) && handled;
+	}
+
+	void run() {
+		MSG msg;
+		while (GetMessage(&msg, nullptr, 0, 0)) DispatchMessage(&msg);
+	}
+
+private:
+	// Resident mode: a stack the host has served, kept loaded and watched
+	struct Stack {
+		std::unique_ptr<Cache>  cache;      // shown by the next open
+		std::unique_ptr<Cache>  pending;    // refreshed cache, swapped in once the menu showing `cache` closes
+		HANDLE                  dir;        // the stack folder, opened for overlapped ReadDirectoryChangesW
+		HANDLE                  stop;       // set to end the watcher
+		std::thread             watcher;
+		std::thread             refresher;
+		bool                    refreshing;
+		bool                    changed;    // changed again during the refresh, or while a cache was pending
+
+		Stack() : dir(INVALID_HANDLE_VALUE), stop(::CreateEvent(0, TRUE, FALSE, 0)), refreshing(false), changed(false) {}
+		~Stack() {
+			if (watcher.joinable()) {
+				::SetEvent(stop);
+				watcher.join();
+			}
+			if (refresher.joinable()) refresher.join();
+			if (dir != INVALID_HANDLE_VALUE) ::CloseHandle(dir);
+			if (stop) ::CloseHandle(stop);
+		}
+	};
+
+	HWND    window;
+	Cache* cache;
+	bool    hide_header;
+	bool    compact_header;
+	bool    dark_mode;
+	bool    background_refresh;
+	bool    live_refresh;
+	bool    resident;
+	bool    prefetch;
+	bool    custom_menu;        // every menu is a ListPopup, not only large folders
+	HMENU   root_menu;
+	bool    menu_open;          // inside TrackPopupMenuEx
+	bool    submenu_opened;     // the user went past the root menu, a live swap would lose their place
+	bool    retrack;            // the root menu was closed to show the refreshed cache or new search results
+	bool    drawn;              // an item of the current menu was drawn, for the first_draw trace mark
+	int     launching;          // launch workers still running
+	RenderContext           render;
+	POINT                   anchor = {};    // where the open menu was shown, its monitor sets the DPI
+	String                  query;          // typed while the menu is open, the root menu lists its matches
+	SearchIndex             search;
+	Arena                   session;        // MenuEntry records and labels of the open menu
+	std::vector<U32>        commands;       // cache item of each command ID of the open menu, from WM_MENU_ITEM on
+	ListPopup*              list = nullptr; // while a ListPopup is tracked
+	// Where the last highlighted large folder sits in the native menus: its list opens next to it, and
+	// leaving the list shows that menu level again
+	struct ListAnchor {
+		U32     item = 0;
+		RECT    rc = {};        // the item, in screen coordinates
+		U32     group = 0;      // the level holding it, 0 for the root menu
+		POINT   menu_pt = {};   // top left of that level's menu window
+	};
+	ListAnchor              list_anchor;
+	bool                    reopen_level = false;   // the next native menu shows list_anchor.group
+	U32                     root_group = 0;         // the level root_menu shows
+	Prefetcher              prefetcher;
+	U32                     hovered = 0;    // item waiting for the prefetch dwell
+	const Cache*            search_cache = nullptr; // the cache `search` was loaded for
+	std::thread             refresher;
+	std::unique_ptr<Cache>  refreshed;
+	std::unordered_map<String, std::unique_ptr<Stack>> stacks;  // resident mode, by lowercase base_dir
+	String  request;            // resident mode: last forwarded command line
+	Stack*  shown = nullptr;    // resident mode: the stack the open menu shows
+	bool    show_next;          // resident mode: show `request` once the open menu is closed
+
+	void set_options(const String& options) {
+		hide_header = options.find(L"--hide-header") != String::npos;
+		compact_header = options.find(L"--compact-header") != String::npos;
+		dark_mode = options.find(L"--dark-mode") != String::npos;
+		live_refresh = options.find(L"--live-refresh") != String::npos;
+		background_refresh = live_refresh || options.find(L"--background-refresh") != String::npos;
+		prefetch = options.find(L"--prefetch") != String::npos;
+		custom_menu = options.find(L"--custom-menu") != String::npos;
+	}
+
+	void create_window(const Char* title) {
 		WNDCLASS wc{0};
 		wc.lpfnWndProc = window_proc;
 		wc.hInstance = GetModuleHandle(nullptr);
 		wc.lpszClassName = STACKY_WINDOW_NAME;
 		RegisterClass(&wc);
 
-		window = CreateWindow(STACKY_WINDOW_NAME, STACKY_WINDOW_NAME,
+		window = CreateWindow(STACKY_WINDOW_NAME, title,
 			WS_POPUP, 0, 0, 0, 0, nullptr, nullptr, wc.hInstance, this);
+	}
 
-		HMENU menu = CreatePopupMenu();
-		build_root_menu(menu);
-
+	// Shows the root menu of `cache` at the cursor. Returns false when it was dismissed, else the chosen
+	// cache item in `item` (0 for the base folder).
+	bool track_menu(U32& item) {
 		POINT pt; GetCursorPos(&pt);
-		
-		SetForegroundWindow(window);
-		TrackPopupMenuEx(menu, TPM_LEFTBUTTON, pt.x, pt.y, window, nullptr);
+		bool chosen = false;
+		query.clear();
+		search_cache = nullptr;
+		list_anchor = ListAnchor();
+		reopen_level = false;
+		if (prefetch) prefetcher.new_session();
+		do {
+			if (retrack) {
+				// The refresh changed the stack while only the root menu was open, the query changed, or a
+				// large folder's list was left: show the new menu in its place
+				retrack = false;
+				if (shown && !reopen_level) {
+					// The old cache is gone, an index loaded for it must not match a new one at its address
+					swap_pending(shown);
+					search_cache = nullptr;
+				}
+				else if (refreshed && !reopen_level) cache = refreshed.get();
+			}
+			anchor = pt;
+			render.prepare(pt, dark_mode);
+			cache->set_icon_size(render.icon);
+			commands.clear();
+			SetForegroundWindow(window);
+			drawn = false;
+			menu_open = true;
+			// The results of type-to-filter come in the same kind of popup as the root they filter
+			if (custom_menu || cache->groups[0].count > LIST_THRESHOLD) {
+				chosen = track_root_list(pt, item);
+			}
+			else {
+				// Normally the root menu; after leaving a large folder's list, the submenu it was chosen from
+				POINT at = pt;
+				root_menu = CreatePopupMenu();
+				root_group = reopen_level ? list_anchor.group : 0;
+				if (reopen_level) {
+					at = list_anchor.menu_pt;
+					build_submenu(root_menu, root_group);
+				}
+				else {
+					build_root_menu(root_menu);
+				}
+				reopen_level = false;
+				Trace::mark("track_menu");
+				UINT id = (UINT)TrackPopupMenuEx(root_menu, TPM_LEFTBUTTON | TPM_RETURNCMD, at.x, at.y, window, nullptr);
+				::KillTimer(window, PREFETCH_TIMER);
+				// The command only needs the cache, the entries can go
+				destroy_menu(root_menu);
+				root_menu = 0;
+				chosen = command_item(id, item);
+				if (chosen && item && cache->is_submenu(item)) {
+					// A folder too large for a native submenu: its list opens next to its item like a submenu,
+					// and going back from it shows the menu level it was chosen from again
+					submenu_opened = true;
+					RECT from = list_anchor.item == item ? list_anchor.rc : RECT{ pt.x, pt.y, pt.x, pt.y };
+					ListPopup::Result result = track_list(cache->child_groups[item], from, ListPopup::SUBMENU, item);
+					chosen = result == ListPopup::CHOSEN;
+					if (result == ListPopup::BACK && list_anchor.item) {
+						reopen_level = list_anchor.group != 0;
+						retrack = true;
+					}
+				}
+			}
+			menu_open = false;
+		} while (retrack);
+		// Lets the next menu of this window close properly when the user clicks away
+		::PostMessage(window, WM_NULL, 0, 0);
+		return chosen;
+	}
+
+	// The cache item of a command of the menu that was just closed
+	bool command_item(UINT id, U32& item) const {
+		if (id == WM_OPEN_TARGET_FOLDER) {
+			item = 0;
+			return true;
+		}
+		if (id < WM_MENU_ITEM || id - WM_MENU_ITEM >= commands.size()) {
+			return false;
+		}
+		item = commands[id - WM_MENU_ITEM];
 		return true;
 	}
 
-	void run() {
-		MSG msg;
-		while (GetMessage(&msg, nullptr, 0, 0)) DispatchMessage(&msg);
+	// The root menu as a ListPopup: the stack's first level, or the results of the query
+	bool track_root_list(POINT pt, U32& item) {
+		RECT at = { pt.x, pt.y, pt.x, pt.y };
+		std::vector<MenuNode> nodes;
+		Trace::mark("track_menu");
+		if (query.empty()) {
+			MenuTree::build_level(*cache, 0, nodes);
+			return track_list(nodes, at, hide_header ? String() : header_label(), 0, item) == ListPopup::CHOSEN;
+		}
+		String caption;
+		search_results(nodes, caption);
+		return track_list(nodes, at, caption, ListPopup::CAPTION, item) == ListPopup::CHOSEN;
 	}
 
-private:
-	HWND    window;
-	Cache* cache;
-	bool    hide_header;
-	bool    compact_header;
-	bool    dark_mode;
-	IconCache   icon_cache;
+	ListPopup::Result track_list(const std::vector<MenuNode>& nodes, const RECT& at, const String& header, U32 flags, U32& item) {
+		ListPopup popup(*cache, render, dark_mode, submenu_opened);
+		Char typed = 0;
+		list = &popup;
+		ListPopup::Result result = popup.track(window, nodes, at, header, flags, item, typed);
+		list = nullptr;
+		::KillTimer(window, PREFETCH_TIMER);
+		// Typing in the list starts type-to-filter, or edits its query
+		if (result == ListPopup::TYPED) on_menu_char(typed);
+		return result;
+	}
+	ListPopup::Result track_list(U32 group, const RECT& at, U32 flags, U32& item) {
+		cache->load_group(group);
+		std::vector<MenuNode> nodes;
+		MenuTree::build_level(*cache, group, nodes);
+		return track_list(nodes, at, String(), flags, item);
+	}
+
+	// Closes whatever the current menu shows; track_menu() returns soon after
+	void close_menus() {
+		::EndMenu();
+		if (list) list->close();
+	}
+
+	// Resident mode: the command line of a click on any stack
+	bool show_stack(const String& cmd_line) {
+		String stack_path, opts;
+		if (Util::parse_cmd_line(cmd_line, stack_path, opts)) {
+			return false;
+		}
+		set_options(opts);
+		Stack* stack = open_stack(stack_path);
+		if (!stack) {
+			return false;
+		}
+		cache = stack->cache.get();
+		submenu_opened = false;
+		shown = stack;
+
+		// The launch is taken from the cache before anything can replace it
+		U32 item = 0;
+		if (track_menu(item)) launch(item);
+		shown = nullptr;
+		swap_pending(stack);
+		if (stack->cache->damaged && !stack->refreshing) start_refresh(stack, true);
+		Trace::write();
+		if (show_next) {
+			show_next = false;
+			::PostMessage(window, WM_SHOW_STACK, 0, 0);
+		}
+		return true;
+	}
+
+	void on_show_request(const String& cmd_line) {
+		request = cmd_line;
+		if (menu_open) {
+			// Another stack was clicked, close this menu first
+			show_next = true;
+			close_menus();
+		}
+		else {
+			// Not from inside WM_COPYDATA, the sender waits for it to return
+			::PostMessage(window, WM_SHOW_STACK, 0, 0);
+		}
+	}
+
+	// Resident mode: the loaded stack for the path, loading and watching it on first use
+	Stack* open_stack(const String& stack_path) {
+		String key = Cache::base_dir_of(stack_path);
+		::CharLowerBuff(&key[0], (DWORD)key.size());
+		auto found = stacks.find(key);
+		if (found != stacks.end()) {
+			return found->second.get();
+		}
+
+		std::unique_ptr<Cache> c(new Cache(stack_path));
+		bool cached = background_refresh && c->load_cached();
+		if (!cached && (!c->scan() || !c->load())) {
+			return nullptr;
+		}
+		Stack* stack = new Stack();
+		stacks[key].reset(stack);
+		stack->cache = std::move(c);
+		stack->dir = ::CreateFile(stack->cache->base_dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+		if (stack->dir != INVALID_HANDLE_VALUE && stack->stop) {
+			stack->watcher = std::thread(watch, window, stack);
+		}
+		if (cached) {
+			start_refresh(stack);
+		}
+		return stack;
+	}
+
+	// Watcher thread: tells the host when anything but the cache files changed under the stack folder.
+	// Reads are overlapped so ~Stack can end the thread at any point through the `stop` event.
+	static void watch(HWND host, Stack* stack) {
+		DWORD changes[16 * 1024];   // ReadDirectoryChangesW needs DWORD alignment
+		DWORD size = 0;
+		const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+		OVERLAPPED io{};
+		io.hEvent = ::CreateEvent(0, TRUE, FALSE, 0);
+		HANDLE waits[] = { stack->stop, io.hEvent };
+		while (io.hEvent && ::ReadDirectoryChangesW(stack->dir, changes, sizeof(changes), TRUE, filter, 0, &io, 0)) {
+			if (::WaitForMultipleObjects(2, waits, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+				// Stopped: the read writes into `changes`, it has to be over before the frame goes
+				::CancelIoEx(stack->dir, &io);
+				::GetOverlappedResult(stack->dir, &io, &size, TRUE);
+				break;
+			}
+			if (!::GetOverlappedResult(stack->dir, &io, &size, FALSE)) {
+				break;
+			}
+			// An empty result means the buffer overflowed, anything may have changed
+			bool relevant = size == 0;
+			for (Byte* p = (Byte*)changes; size && !relevant; ) {
+				auto* info = (FILE_NOTIFY_INFORMATION*)p;
+				StringView name(info->FileName, info->FileNameLength / sizeof(Char));
+				relevant = name.compare(0, CACHE_FILE_NAME.size(), CACHE_FILE_NAME) != 0;
+				if (!info->NextEntryOffset) break;
+				p += info->NextEntryOffset;
+			}
+			if (relevant) {
+				::PostMessage(host, WM_STACK_CHANGED, 0, (LPARAM)stack);
+			}
+		}
+		if (io.hEvent) ::CloseHandle(io.hEvent);
+	}
+
+	void on_stack_changed(Stack* stack) {
+		// Edits come in bursts, refresh once they settle
+		::SetTimer(window, (UINT_PTR)stack, REFRESH_DELAY, 0);
+	}
+
+	// Resident mode: the stack a refresh timer was set for, null for any other timer id
+	Stack* timer_stack(UINT_PTR id) const {
+		for (auto& s : stacks) {
+			if ((UINT_PTR)s.second.get() == id) return s.second.get();
+		}
+		return nullptr;
+	}
+
+	void on_stack_timer(Stack* stack) {
+		::KillTimer(window, (UINT_PTR)stack);
+		// A pending cache keeps the shown one mapped as .old, a save now could not swap its file in
+		if (stack->refreshing || stack->pending) {
+			stack->changed = true;
+			return;
+		}
+		start_refresh(stack);
+	}
+
+	void start_refresh(Stack* stack, bool repair = false) {
+		if (stack->refresher.joinable()) stack->refresher.join();
+		stack->refreshing = true;
+		stack->changed = false;
+		stack->refresher = std::thread(&App::refresh, this, stack->cache->base_dir, stack, repair);
+	}
+
+	// Resident mode: once no menu shows the stack, swaps in its refreshed cache and starts a refresh that waited for it
+	void swap_pending(Stack* stack) {
+		if (stack->pending) {
+			if (cache == stack->cache.get()) cache = stack->pending.get();
+			stack->cache = std::move(stack->pending);
+		}
+		if (stack->changed && !stack->refreshing) start_refresh(stack);
+	}
+
+	// Worker thread: scans the stack and rebuilds the cache if it changed since the shown one was written.
+	// Works on its own Cache, the shown one is only touched by the UI thread.
+	// `stack` is null outside resident mode. `repair` rebuilds a damaged cache even if the stack did not change.
+	void refresh(String stack_path, Stack* stack, bool repair) {
+		Trace::Phase phase("refresh");
+		ComInit com;
+		std::unique_ptr<Cache> fresh(new Cache(stack_path));
+		if (!fresh->scan() || !fresh->load(repair) || !fresh->was_rebuilt) {
+			fresh.reset();
+		}
+		// The UI thread owns the new cache once the message is posted
+		if (::PostMessage(window, WM_CACHE_REFRESHED, (WPARAM)stack, (LPARAM)fresh.get())) {
+			fresh.release();
+		}
+	}
+
+	void on_cache_refreshed(Stack* stack, Cache* fresh) {
+		if (stack) {
+			// Resident mode: the next open of the stack shows the new cache
+			stack->refresher.join();
+			stack->refreshing = false;
+			if (fresh) stack->pending.reset(fresh);
+			// Unless a menu shows it, the old cache goes now and releases its mapping of the renamed file.
+			// With --live-refresh a root-only menu is closed and shown again from the new cache.
+			if (!menu_open || cache != stack->cache.get()) swap_pending(stack);
+			else if (live_refresh && stack->pending && !submenu_opened) {
+				retrack = true;
+				close_menus();
+			}
+			else if (stack->changed && !stack->pending) start_refresh(stack);
+			return;
+		}
+		if (!fresh) return;
+		refreshed.reset(fresh);
+		// Otherwise the new cache is on disk for the next open
+		if (!live_refresh || !menu_open || submenu_opened) return;
+		retrack = true;
+		close_menus();
+	}
 
 	// helper: make a display label for the base folder
 	const String header_label() {
@@ -822,26 +2589,27 @@ private:
 		InsertMenuItem(menu, -1, TRUE, &mii);
 	}
 
-	static bool IsSeparatorFile(String name) {
-		// handle ".separator" and ".separator.lnk"
-		if (Util::ends_with(name, L".lnk")) name = Util::rtrim(name, L".lnk");
-		return Util::ends_with(name, L".separator");
-	}
-
 	void build_root_menu(HMENU menu) {
-		if (!hide_header && cache->items.size() >= 1) {
-			auto* e = new MenuEntry{};
-			e->item = &cache->items[0];      // base folder cache item
+		if (!query.empty()) {
+			build_results_menu(menu);
+			return;
+		}
+		Trace::Phase phase("build_root_menu");
+		std::vector<MenuEntry*> added;
+		if (!hide_header && cache->item_count() >= 1) {
+			auto* e = session.make<MenuEntry>();
+			e->item = 0;      // base folder cache item
 			e->is_submenu = false;
 			e->populated = false;
 			e->is_path = true;
-			e->text = header_label();
+			e->text = session.intern(header_label());
+			added.push_back(e);
 
 			MENUITEMINFO mii{ sizeof(mii) };
 			mii.fMask = MIIM_FTYPE | MIIM_DATA | MIIM_STRING | MIIM_ID;
 			mii.fType = MFT_OWNERDRAW;
 			mii.dwItemData = (ULONG_PTR)e;
-			mii.dwTypeData = (LPWSTR)e->text.c_str();
+			mii.dwTypeData = (LPWSTR)e->text.data();
 			mii.wID = WM_OPEN_TARGET_FOLDER;  // special command
 
 			InsertMenuItem(menu, -1, TRUE, &mii);
@@ -850,131 +2618,266 @@ private:
 			InsertSeparator(menu);
 		}
 
-		for (size_t i = 1; i < cache->items.size(); ++i) {
-			auto& it = cache->items[i];
+		// root: group 0 holds the direct children (and the base folder item)
+		add_items(menu, 0, added);
+		measure_entries(added);
+	}
 
-			// root: only direct children
-			if (it.name.find(DIR_SEP) != String::npos) continue;
+	void build_submenu(HMENU menu, DWORD group) {
+		Trace::Phase phase("build_submenu");
+		// decode the folder's records on first open
+		cache->load_group(group);
+		std::vector<MenuEntry*> added;
+		add_items(menu, group, added);
+		measure_entries(added);
+	}
 
-			if (IsSeparatorFile(it.name)) {
-				InsertSeparator(menu);
-				continue;
-			}
+	// Type-to-filter: the items of any level whose label contains the query, and the line showing it
+	void search_results(std::vector<MenuNode>& nodes, String& caption) {
+		if (search_cache != cache) {
+			search_cache = search.load(*cache) ? cache : nullptr;
+		}
+		std::vector<U32> found;
+		if (search_cache) search.find(query, MAX_SEARCH_RESULTS, found);
 
-			// create MenuEntry once; never store mixed pointer types
-			auto* e = new MenuEntry{};
-			e->item = &it;
-			e->is_submenu = it.is_submenu;
-			e->populated = false;
+		// Only the folders holding a match get their records decoded
+		for (U32 item : found) {
+			cache->load_group(cache->parents[item]);
+			nodes.push_back(MenuNode{ item, cache->label(item), false, cache->is_submenu(item), cache->child_groups[item] });
+		}
+		caption = found.empty() ? query + L"  (no matches)" : query;
+	}
 
-			// display text
-			if (it.is_submenu) {
-				String t = it.name;
-				t = Util::rtrim(t, SUBMENU_SUFFIX);
-				e->text = t;
-				e->submenu_prefix = it.name + DIR_SEP; // RELATIVE prefix!
-			}
-			else {
-				String t = it.name;
-				t = Util::rtrim(t, L".bat");
-				t = Util::rtrim(t, L".cmd");
-				t = Util::rtrim(t, L".exe");
-				t = Util::rtrim(t, L".lnk");
-				t = Util::rtrim(t, L".url");
-				t = Util::rtrim(t, L".vbs");
-				e->text = t;
-			}
+	// The query on top, then the results
+	void build_results_menu(HMENU menu) {
+		Trace::Phase phase("build_results_menu");
+		std::vector<MenuNode> nodes;
+		String caption;
+		search_results(nodes, caption);
+
+		std::vector<MenuEntry*> added;
+		auto* e = session.make<MenuEntry>();
+		e->item = 0;
+		e->is_submenu = false;
+		e->populated = false;
+		e->is_path = true;
+		e->text = session.intern(caption);
+		added.push_back(e);
 
-			MENUITEMINFO mii{ sizeof(mii) };
-			mii.fMask = MIIM_FTYPE | MIIM_DATA | MIIM_STRING | (it.is_submenu ? MIIM_SUBMENU : MIIM_ID);
-			mii.fType = MFT_OWNERDRAW;
-			mii.dwItemData = (ULONG_PTR)e;
-			mii.dwTypeData = (LPWSTR)e->text.c_str();
+		MENUITEMINFO mii{ sizeof(mii) };
+		mii.fMask = MIIM_FTYPE | MIIM_DATA | MIIM_STRING | MIIM_STATE;
+		mii.fType = MFT_OWNERDRAW;
+		mii.fState = MFS_DISABLED;
+		mii.dwItemData = (ULONG_PTR)e;
+		mii.dwTypeData = (LPWSTR)e->text.data();
+		InsertMenuItem(menu, -1, TRUE, &mii);
+		if (!nodes.empty()) InsertSeparator(menu);
+		for (const MenuNode& node : nodes) {
+			add_entry(menu, node.item, node.text, node.is_submenu, node.group, added);
+		}
+		measure_entries(added);
+	}
 
-			if (it.is_submenu) {
-				mii.hSubMenu = CreatePopupMenu();
-			}
-			else {
-				mii.wID = WM_MENU_ITEM + (UINT)i; // unique ID per item
+	// Labels and separators come from MenuTree, this only turns them into owner-draw items
+	void add_items(HMENU menu, DWORD group, std::vector<MenuEntry*>& added) {
+		std::vector<MenuNode> nodes;
+		MenuTree::build_level(*cache, group, nodes);
+		for (MenuNode& node : nodes) {
+			if (node.is_separator) {
+				InsertSeparator(menu);
+				continue;
 			}
-
-			InsertMenuItem(menu, -1, TRUE, &mii);
+			add_entry(menu, node.item, node.text, node.is_submenu, node.group, added);
 		}
 	}
 
-	void build_submenu(HMENU menu, const String& prefix) {
-		for (size_t i = 0; i < cache->items.size(); ++i) {
-			auto& it = cache->items[i];
+	void add_entry(HMENU menu, U32 item, StringView text, bool is_submenu, U32 group, std::vector<MenuEntry*>& added) {
+		// create MenuEntry once; never store mixed pointer types
+		auto* e = session.make<MenuEntry>();
+		e->item = item;
+		e->is_list = is_submenu && cache->groups[group].count > LIST_THRESHOLD;
+		e->is_submenu = is_submenu && !e->is_list;
+		e->populated = false;
+		e->group = group;
+		e->text = session.intern(text);
+		added.push_back(e);
 
-			// must match relative prefix
-			if (it.name.rfind(prefix, 0) != 0) continue;
+		MENUITEMINFO mii{ sizeof(mii) };
+		mii.fMask = MIIM_FTYPE | MIIM_DATA | MIIM_STRING | (e->is_submenu ? MIIM_SUBMENU : MIIM_ID);
+		mii.fType = MFT_OWNERDRAW;
+		mii.dwItemData = (ULONG_PTR)e;
+		mii.dwTypeData = (LPWSTR)e->text.data();
 
-			String rel = it.name.substr(prefix.size());
+		if (e->is_submenu) {
+			mii.hSubMenu = CreateLazySubmenu(e);
+		}
+		else if (commands.size() < MAX_MENU_COMMANDS) {
+			// IDs index `commands`, so any cache index fits the 16 bits WM_MENUSELECT reports
+			mii.wID = WM_MENU_ITEM + (UINT)commands.size();
+			commands.push_back(item);
+		}
+		else {
+			mii.fMask |= MIIM_STATE;
+			mii.fState = MFS_DISABLED;
+		}
 
-			if (IsSeparatorFile(rel)) {
-				InsertSeparator(menu);
-				continue;
-			}
+		InsertMenuItem(menu, -1, TRUE, &mii);
+	}
 
-			// direct children only (unless it.is_submenu)
-			if (!it.is_submenu && rel.find(DIR_SEP) != String::npos) continue;
+	// Text layout for a whole menu level, so WM_MEASUREITEM is a lookup. Widths come from the cache's
+	// table; the ones still missing are measured together with a single DC.
+	void measure_entries(const std::vector<MenuEntry*>& entries) {
+		if (!render.font) render.prepare(anchor, dark_mode);
+		if (cache->text_layout != render.layout || cache->text_widths.size() != cache->item_count()) {
+			cache->text_widths.assign(cache->item_count(), -1);
+			cache->text_layout = render.layout;
+		}
 
-			auto* e = new MenuEntry{};
-			e->item = &it;
-			e->is_submenu = it.is_submenu;
-			e->populated = false;
+		HDC hdc = 0;
+		HFONT old = 0;
+		int max_path = 0;
+		for (MenuEntry* e : entries) {
+			// the header text depends on the options of the request, so it is not kept in the table
+			int width = e->is_path ? -1 : cache->text_widths[e->item];
+			if (width < 0) {
+				if (!hdc) {
+					hdc = GetDC(window);
+					old = (HFONT)SelectObject(hdc, render.font);
+				}
+				SIZE ts{};
+				GetTextExtentPoint32(hdc, e->text.data(), (int)e->text.size(), &ts);
+				width = ts.cx;
+			}
 
-			if (it.is_submenu) {
-				// must be direct child submenu folder
-				if (rel.find(DIR_SEP) != String::npos) { delete e; continue; }
-				e->text = Util::rtrim(rel, SUBMENU_SUFFIX);
-				e->submenu_prefix = it.name + DIR_SEP;
+			// cap text width for path entries (smart ellipsis will be used when drawing)
+			if (e->is_path) {
+				if (!max_path) {
+					// cap to ~70% of work area width on the monitor where the cursor is
+					RECT wa = Util::GetWorkAreaForMonitor(Util::GetMonitorFromCursor());
+					max_path = (int)((wa.right - wa.left) * 0.70);
+				}
+				e->text_width = min(width, max_path);
 			}
 			else {
-				String t = rel;
-				t = Util::rtrim(t, L".lnk");
-				t = Util::rtrim(t, L".vbs");
-				t = Util::rtrim(t, L".cmd");
-				t = Util::rtrim(t, L".bat");
-				e->text = t;
+				cache->text_widths[e->item] = width;
+				e->text_width = width;
 			}
+		}
+		if (hdc) {
+			SelectObject(hdc, old);
+			ReleaseDC(window, hdc);
+		}
+	}
 
-			MENUITEMINFO mii{ sizeof(mii) };
-			mii.fMask = MIIM_FTYPE | MIIM_DATA | MIIM_STRING | (it.is_submenu ? MIIM_SUBMENU : MIIM_ID);
-			mii.fType = MFT_OWNERDRAW;
-			mii.dwItemData = (ULONG_PTR)e;
-			mii.dwTypeData = (LPWSTR)e->text.c_str();
+	// Empty popup that remembers its entry; it is filled by on_init_menu_popup when first opened
+	static HMENU CreateLazySubmenu(MenuEntry* e) {
+		HMENU submenu = CreatePopupMenu();
+		MENUINFO mi{ sizeof(mi) };
+		mi.fMask = MIM_MENUDATA;
+		mi.dwMenuData = (ULONG_PTR)e;
+		SetMenuInfo(submenu, &mi);
+		return submenu;
+	}
 
-			if (it.is_submenu) mii.hSubMenu = CreatePopupMenu();
-			else mii.wID = WM_MENU_ITEM + (UINT)i;
+	// Owner-drawn items have no mnemonics, so every typed character ends up here. The root menu is
+	// closed and shown again with the matches of the new query.
+	LRESULT on_menu_char(Char c) {
+		if (c == VK_BACK && !query.empty()) {
+			query.pop_back();
+		}
+		else if (c >= L' ' && query.size() < MAX_QUERY_LENGTH) {
+			query += c;
+		}
+		else {
+			return MAKELRESULT(0, MNC_IGNORE);
+		}
+		retrack = true;
+		::EndMenu();
+		return MAKELRESULT(0, MNC_CLOSE);
+	}
 
-			InsertMenuItem(menu, -1, TRUE, &mii);
+	// A highlighted program is prefetched once it stayed highlighted for PREFETCH_DWELL, so sweeping
+	// the mouse over the menu reads nothing. A highlighted large folder gets its place noted.
+	void on_menu_select(UINT id, UINT flags, HMENU menu) {
+		U32 item = 0;
+		bool command = !(flags & (MF_POPUP | MF_SEPARATOR)) && flags != 0xFFFF && command_item(id, item) && item;
+		if (command && cache->is_submenu(item)) note_list_item(item, id, menu);
+		on_item_select(command ? item : 0);
+	}
+
+	// The item highlighted in a native menu or a ListPopup, 0 for none. A program is prefetched once it
+	// stays highlighted for PREFETCH_DWELL.
+	void on_item_select(U32 item) {
+		if (!prefetch) return;
+		::KillTimer(window, PREFETCH_TIMER);
+		prefetcher.cancel();
+		if (!item) {
+			return;
+		}
+		hovered = item;
+		::SetTimer(window, PREFETCH_TIMER, PREFETCH_DWELL, nullptr);
+	}
+
+	// Only large folders are commands among submenus, a menu level holds few enough items to search
+	void note_list_item(U32 item, UINT id, HMENU menu) {
+		int count = GetMenuItemCount(menu);
+		for (int pos = 0; pos < count; pos++) {
+			if (GetMenuItemID(menu, pos) != id) continue;
+			RECT rc;
+			if (!GetMenuItemRect(nullptr, menu, pos, &rc)) return;
+			MENUINFO mi{ sizeof(mi) };
+			mi.fMask = MIM_MENUDATA;
+			auto* e = menu != root_menu && GetMenuInfo(menu, &mi) ? (MenuEntry*)mi.dwMenuData : nullptr;
+			RECT wr = rc;
+			HWND popup = menu_window(menu);
+			if (popup) GetWindowRect(popup, &wr);
+			list_anchor.item = item;
+			list_anchor.rc = rc;
+			list_anchor.group = e ? e->group : root_group;
+			list_anchor.menu_pt = POINT{ wr.left, wr.top };
+			return;
+		}
+	}
+
+	// The popup window showing `menu`. Menu windows have class #32768 and report their menu to MN_GETHMENU;
+	// only this thread's are asked, the others belong to other menus.
+	static HWND menu_window(HMENU menu) {
+		for (HWND w = FindWindowEx(nullptr, nullptr, L"#32768", nullptr); w; w = FindWindowEx(nullptr, w, L"#32768", nullptr)) {
+			if (GetWindowThreadProcessId(w, nullptr) == GetCurrentThreadId() && (HMENU)SendMessage(w, MN_GETHMENU, 0, 0) == menu) return w;
 		}
+		return nullptr;
+	}
+
+	void on_prefetch_timer() {
+		::KillTimer(window, PREFETCH_TIMER);
+		if (!menu_open || hovered >= cache->item_count()) return;
+		// The program a shortcut starts, or the item itself when it is one
+		const Cache::Target* t = cache->target(hovered);
+		String program = t ? String(cache->str(t->target)) : cache->path(cache->name(hovered));
+		String lower = program;
+		::CharLowerBuff(&lower[0], (DWORD)lower.size());
+		if (Util::ends_with(lower, L".exe")) prefetcher.request(program);
 	}
 
 	void on_init_menu_popup(HMENU hMenu) {
-		int c = GetMenuItemCount(hMenu);
-		for (int i = 0; i < c; ++i) {
-			MENUITEMINFO mii{ sizeof(mii) };
-			mii.fMask = MIIM_DATA | MIIM_SUBMENU;
-			GetMenuItemInfo(hMenu, i, TRUE, &mii);
+		if (hMenu != root_menu) submenu_opened = true;
 
-			if (!mii.hSubMenu) continue;
+		MENUINFO mi{ sizeof(mi) };
+		mi.fMask = MIM_MENUDATA;
+		GetMenuInfo(hMenu, &mi);
 
-			auto* e = (MenuEntry*)mii.dwItemData;
-			if (!e || !e->is_submenu || e->populated) continue;
+		auto* e = (MenuEntry*)mi.dwMenuData;
+		if (!e || !e->is_submenu || e->populated) return;
 
-			build_submenu(mii.hSubMenu, e->submenu_prefix);
-			e->populated = true;
-		}
+		build_submenu(hMenu, e->group);
+		e->populated = true;
 	}
 
 	void on_measure_item(MEASUREITEMSTRUCT* mis) {
 		if (mis->CtlType != ODT_MENU) return;
 
 		if (mis->itemData == 0) {
-			UINT dpi = GetDpiForWindow(window);
-			mis->itemHeight = MulDiv(6, dpi, 96);   // slim separator
+			mis->itemHeight = render.separator;
 			mis->itemWidth = 10;
 			return;
 		}
@@ -982,118 +2885,161 @@ private:
 		auto* e = (MenuEntry*)mis->itemData;
 		if (!e) return;
 
-		UINT dpi = GetDpiForWindow(window);
-		int icon = MulDiv(16, dpi, 96);
-		int pad = MulDiv(12, dpi, 96);
-
-		HDC hdc = GetDC(window);
-		HFONT font = (HFONT)GetStockObject(DEFAULT_GUI_FONT);
-		HFONT old = (HFONT)SelectObject(hdc, font);
-
-		SIZE ts{};
-		GetTextExtentPoint32(hdc, e->text.c_str(), (int)e->text.size(), &ts);
-
-		SelectObject(hdc, old);
-		ReleaseDC(window, hdc);
-
-		// cap text width for path entries (smart ellipsis will be used when drawing)
-		int maxText = ts.cx;
-		if (e->is_path) {
-			// cap to ~70% of work area width on the monitor where the cursor is
-			HMONITOR mon = Util::GetMonitorFromCursor();
-			RECT wa = Util::GetWorkAreaForMonitor(mon);
-			int maxMenu = (int)((wa.right - wa.left) * 0.70);
-			maxText = min(ts.cx, maxMenu);
-		}
-
-		mis->itemHeight = max((UINT)GetSystemMetrics(SM_CYMENU), (UINT)(icon + pad / 2));
-		mis->itemWidth = icon + pad + maxText + pad;
+		// text extents were laid out by measure_entries() when the level was built
+		mis->itemHeight = max((UINT)GetSystemMetrics(SM_CYMENU), (UINT)(render.icon + render.pad / 2));
+		mis->itemWidth = render.icon + render.pad + e->text_width + render.pad;
 	}
 
 	void on_draw_item(DRAWITEMSTRUCT* dis) {
 		if (dis->CtlType != ODT_MENU) return;
 
 		auto* e = (MenuEntry*)dis->itemData;
+		if (!render.font) render.prepare(anchor, dark_mode);
+
+		RECT rc = dis->rcItem;
+		HDC dc = render.begin(dis->hDC, rc);
+
 		// ----- SEPARATOR DRAW -----
 		if (!e) {
-			COLORREF bg = dark_mode ? RGB(32, 32, 32) : GetSysColor(COLOR_MENU);
-			COLORREF line = dark_mode ? RGB(70, 70, 70) : GetSysColor(COLOR_3DSHADOW);
-
-			// Fill background
-			HBRUSH b = CreateSolidBrush(bg);
-			FillRect(dis->hDC, &dis->rcItem, b);
-			DeleteObject(b);
+			FillRect(dc, &rc, render.bg_brush);
 
 			// Full width, small padding
-			UINT dpi = GetDpiForWindow(window);
-			int pad = MulDiv(2, dpi, 96);
-
-			int left = dis->rcItem.left + pad;
-			int right = dis->rcItem.right - pad;
-			int y = (dis->rcItem.top + dis->rcItem.bottom) / 2;
-
-			// Draw line
-			HPEN pen = CreatePen(PS_SOLID, 1, line);
-			HPEN old = (HPEN)SelectObject(dis->hDC, pen);
+			int y = (rc.top + rc.bottom) / 2;
+			HPEN old = (HPEN)SelectObject(dc, render.line_pen);
+			MoveToEx(dc, rc.left + render.line_pad, y, nullptr);
+			LineTo(dc, rc.right - render.line_pad, y);
+			SelectObject(dc, old);
 
-			MoveToEx(dis->hDC, left, y, nullptr);
-			LineTo(dis->hDC, right, y);
-
-			SelectObject(dis->hDC, old);
-			DeleteObject(pen);
+			render.end(dis->hDC, dis->rcItem, dc);
 			return;
 		}
 
-		if (!e || !e->item) return;
+		if (Trace::on() && !drawn) {
+			drawn = true;
+			Trace::mark("first_draw");
+		}
 
 		const bool sel = (dis->itemState & ODS_SELECTED) != 0;
 		const bool disab = (dis->itemState & (ODS_DISABLED | ODS_GRAYED)) != 0;
 
-		// Colors
-		const COLORREF bg = dark_mode ? RGB(32, 32, 32) : GetSysColor(COLOR_MENU);
-		const COLORREF fg = dark_mode ? RGB(240, 240, 240) : GetSysColor(COLOR_MENUTEXT);
-		const COLORREF disfg = dark_mode ? RGB(140, 140, 140) : GetSysColor(COLOR_GRAYTEXT);
+		// Paint background
+		FillRect(dc, &rc, sel ? render.selected_brush : render.bg_brush);
 
-		// Selection colors (avoid the bright default blue in dark mode)
-		const COLORREF selBg = dark_mode ? RGB(64, 64, 64) : GetSysColor(COLOR_HIGHLIGHT);
-		const COLORREF selFg = dark_mode ? RGB(255, 255, 255) : GetSysColor(COLOR_HIGHLIGHTTEXT);
+		// Icon (DPI-scaled) + alpha blend, straight from the stack's atlas
+		int icon = render.icon;
+		int x = rc.left + 4;
+		int y = rc.top + (rc.bottom - rc.top - icon) / 2;
 
-		// Paint background
-		HBRUSH hbr = CreateSolidBrush(sel ? selBg : bg);
-		FillRect(dis->hDC, &dis->rcItem, hbr);
-		DeleteObject(hbr);
+		cache->atlas.draw(dc, cache->slots[e->item], x, y, icon, disab ? 140 : 255); // slightly dim icons when disabled
+
+		// Text
+		RECT tr = rc;
+		tr.left += icon + 8;
 
-		// Icon (DPI-scaled) + alpha blend
-		auto& ic = icon_cache.get(window, e->item->bmp.hBmp);
+		SetBkMode(dc, TRANSPARENT);
+		SetTextColor(dc, disab ? render.disabled_fg : (sel ? render.selected_fg : render.fg));
 
-		int x = dis->rcItem.left + 4;
-		int y = dis->rcItem.top + (dis->rcItem.bottom - dis->rcItem.top - ic.sz.cy) / 2;
+		UINT flags = DT_SINGLELINE | DT_VCENTER | DT_LEFT;
+		if (e->is_path) flags |= DT_PATH_ELLIPSIS;
+		else           flags |= DT_END_ELLIPSIS;
 
-		HDC mem = CreateCompatibleDC(dis->hDC);
-		HGDIOBJ old = SelectObject(mem, ic.bmp);
+		DrawText(dc, e->text.data(), (int)e->text.size(), &tr, flags);
+		if (e->is_list) {
+			// the arrow a native submenu would get
+			RECT ar = rc;
+			ar.right -= render.pad / 2;
+			DrawText(dc, L"\u203A", 1, &ar, DT_SINGLELINE | DT_VCENTER | DT_RIGHT);
+		}
+		render.end(dis->hDC, dis->rcItem, dc);
+	}
 
-		BLENDFUNCTION bf{};
-		bf.BlendOp = AC_SRC_OVER;
-		bf.SourceConstantAlpha = disab ? 140 : 255; // slightly dim icons when disabled
-		bf.AlphaFormat = AC_SRC_ALPHA;
+	// What a menu command starts. It is collected on the UI thread, so the launch worker does not need the cache.
+	struct LaunchRequest {
+		String  file;       // the stack entry
+		String  target;     // resolved by the rebuild, empty to open `file`
+		String  arguments;
+		String  work_dir;
+		int     show_cmd;
+		bool    select;     // Shift+click: show the target in Explorer
+	};
 
-		AlphaBlend(dis->hDC, x, y, ic.sz.cx, ic.sz.cy, mem, 0, 0, ic.sz.cx, ic.sz.cy, bf);
+	// Starts the command on a worker, so a slow launch (UAC prompt, network target) does not block the message loop
+	bool launch(U32 item) {
+		LaunchRequest r{};
+		r.show_cmd = SW_NORMAL;
+		if (item == 0) {
+			r.file = cache->path();
+		}
+		else if (item < cache->item_count()) {
+			r.file = cache->path(cache->name(item));
+			if (const Cache::Target* t = cache->target(item)) {
+				r.target = cache->str(t->target);
+				r.arguments = cache->str(t->arguments);
+				r.work_dir = cache->str(t->work_dir);
+				if (t->show_cmd) r.show_cmd = t->show_cmd;
+			}
+			r.select = (GetKeyState(VK_SHIFT) & 0x8000) != 0;
+		}
+		else {
+			return false;
+		}
+		launching++;
+		// Detached: it owns its request and reports back with WM_LAUNCHED
+		std::thread(&App::run_launch, window, std::move(r)).detach();
+		return true;
+	}
 
-		SelectObject(mem, old);
-		DeleteDC(mem);
+	static void run_launch(HWND window, LaunchRequest r) {
+		Trace::Phase phase("launch");
+		HRESULT com = ::CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
 
-		// Text
-		RECT tr = dis->rcItem;
-		tr.left += ic.sz.cx + 8;
+		// Targets resolved by the rebuild are used directly. A URL is always there; a moved or deleted
+		// target falls back to the shortcut itself, which lets the shell look for it.
+		bool is_url = r.target.find(L"://") != String::npos;
+		bool direct = !r.target.empty() && (is_url || ::GetFileAttributes(r.target.c_str()) != INVALID_FILE_ATTRIBUTES);
 
-		SetBkMode(dis->hDC, TRANSPARENT);
-		SetTextColor(dis->hDC, disab ? disfg : (sel ? selFg : fg));
+		if (r.select)
+		{
+			TCHAR  filepath[MAX_PATH] = { 0 };
+			if (direct && !is_url) StringCchCopy(filepath, _countof(filepath), r.target.c_str());
+			else Util::ResolveShortcut(NULL, r.file.c_str(), filepath, _countof(filepath));
 
-		UINT flags = DT_SINGLELINE | DT_VCENTER | DT_LEFT;
-		if (e->is_path) flags |= DT_PATH_ELLIPSIS;
-		else           flags |= DT_END_ELLIPSIS;
+			ITEMIDLIST* pidl = ILCreateFromPath(filepath);
+			if (pidl)
+			{
+				SHOpenFolderAndSelectItems(pidl, 0, 0, 0);
+				ILFree(pidl);
+			}
+		}
+		else
+		{
+			// NOASYNC: returns once the target is started, UAC consent included, so the process can exit after it
+			SHELLEXECUTEINFO sei{ sizeof(sei) };
+			sei.fMask = SEE_MASK_NOASYNC;
+			sei.lpFile = direct ? r.target.c_str() : r.file.c_str();
+			sei.lpParameters = direct && !r.arguments.empty() ? r.arguments.c_str() : nullptr;
+			sei.lpDirectory = direct && !r.work_dir.empty() ? r.work_dir.c_str() : nullptr;
+			sei.nShow = direct ? r.show_cmd : SW_NORMAL;
+			::ShellExecuteEx(&sei);
+		}
+
+		if (SUCCEEDED(com)) ::CoUninitialize();
+		::PostMessage(window, WM_LAUNCHED, 0, 0);
+	}
+
+	void on_launched() {
+		if (--launching == 0 && !resident) quit();
+	}
+
+	void quit() {
+		::PostQuitMessage(0);
+		::DestroyWindow(window);
+	}
 
-		DrawText(dis->hDC, e->text.c_str(), -1, &tr, flags);
+	// Destroys a menu tree with its submenus, and the MenuEntry records of all of them in one go
+	void destroy_menu(HMENU menu) {
+		::DestroyMenu(menu);
+		session.reset();
 	}
 
 	static LRESULT CALLBACK window_proc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp) {
@@ -1105,10 +3051,25 @@ private:
 				(LONG_PTR)((CREATESTRUCT*)lp)->lpCreateParams);
 			break;
 
+		case WM_CACHE_REFRESHED:
+			app->on_cache_refreshed((Stack*)wp, (Cache*)lp);
+			break;
+
 		case WM_INITMENUPOPUP:
 			app->on_init_menu_popup((HMENU)wp);
 			break;
 
+		case WM_MENUCHAR:
+			return app->on_menu_char((Char)LOWORD(wp));
+
+		case WM_MENUSELECT:
+			app->on_menu_select(LOWORD(wp), HIWORD(wp), (HMENU)lp);
+			break;
+
+		case WM_LIST_SELECT:
+			app->on_item_select((U32)wp);
+			break;
+
 		case WM_MEASUREITEM:
 			app->on_measure_item((MEASUREITEMSTRUCT*)lp);
 			return TRUE;
@@ -1117,46 +3078,38 @@ private:
 			app->on_draw_item((DRAWITEMSTRUCT*)lp);
 			return TRUE;
 
-		case WM_COMMAND: {
-			UINT id = LOWORD(wp);
-			if (id == WM_OPEN_TARGET_FOLDER) {
-				ShellExecute(nullptr, nullptr, app->cache->path().c_str(), nullptr, nullptr, SW_NORMAL);
-				return TRUE;
-			}
-
-			if (id >= WM_MENU_ITEM) {
-				size_t idx = id - WM_MENU_ITEM;
-				auto& it = app->cache->items[idx];
-				String cmd = app->cache->path(it.name);
-
-				if (GetKeyState(VK_SHIFT) & 0x8000)
-				{
-					TCHAR  filepath[MAX_PATH] = { 0 };
-					Util::ResolveShortcut(NULL, cmd.c_str(), filepath, _countof(filepath));
+		case WM_LAUNCHED:
+			app->on_launched();
+			break;
 
-					ITEMIDLIST* pidl = ILCreateFromPath(filepath);
-					if (pidl)
-					{
-						SHOpenFolderAndSelectItems(pidl, 0, 0, 0);
-						ILFree(pidl);
-					}
-				}
-				else
-				{
-					ShellExecute(nullptr, nullptr, cmd.c_str(), nullptr, nullptr, SW_NORMAL);
-				}
-			}
+		case WM_DPICHANGED:
+		case WM_SETTINGCHANGE:
+			// Metrics, fonts or colors may have changed, rebuilt by the next menu
+			app->render.invalidate();
 			break;
+
+		case WM_COPYDATA: {
+			// Resident host: a launcher forwarded its command line
+			auto* cds = (COPYDATASTRUCT*)lp;
+			if (!app->resident || cds->dwData != COPYDATA_SHOW_STACK) break;
+			app->on_show_request(String((const Char*)cds->lpData, wcsnlen((const Char*)cds->lpData, cds->cbData / sizeof(Char))));
+			return TRUE;
 		}
-		case WM_EXITMENULOOP:
-			// WM_EXITMENULOOP is sent before WM_COMMAND, so the app termination has to be delayed.
-			// This also allows to wait for the possible UAC prompt.
-			::SetTimer(hwnd, 0, APP_EXIT_DELAY, 0);
+		case WM_SHOW_STACK:
+			app->show_stack(app->request);
+			break;
+
+		case WM_STACK_CHANGED:
+			app->on_stack_changed((Stack*)lp);
 			break;
 
 		case WM_TIMER:
-			::PostQuitMessage(0);
-			::DestroyWindow(hwnd);
+			if (wp == PREFETCH_TIMER) {
+				app->on_prefetch_timer();
+				break;
+			}
+			// Resident host: a changed stack's refresh delay is over
+			if (Stack* stack = app->timer_stack(wp)) app->on_stack_timer(stack);
 			break;
 		}
 		return DefWindowProc(hwnd, msg, wp, lp);
@@ -1167,16 +3120,21 @@ private:
  * App entry point
  **************************************************************************************************/
 int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, LPTSTR cmd_line, int) {
+	// Menus are drawn for the DPI of their monitor instead of being scaled from 96 DPI by the system
+	::SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
 	ComInit com;
 
 	String  stack_path, opts;
 	int     cmd_line_error = Util::parse_cmd_line(cmd_line, stack_path, opts);
+	if (opts.find(L"--trace") != String::npos) {
+		Trace::start();
+	}
+	if (opts.find(L"--shared-icons") != String::npos) {
+		IconStore::enable();
+	}
 	String  err_title = String(L"Stacky v") + STACKY_VERSION_STR + L": ";
 	String  err_msg = L"Path: " + stack_path;
 
-	Cache   cache(stack_path);
-	App     app(&cache, opts);
-
 	if (cmd_line_error == ERR_PATH_MISSING) {
 		Util::msgt(
 			err_title + L"Parameter missing",
@@ -1185,7 +3143,14 @@ int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, LPTSTR cmd_line, int) {
 			L"Options:\n"
 			L"  --hide-header      Hide the top folder item and separator\n"
 			L"  --compact-header   Show only folder name in the header\n"
-			L"  --dark-mode        Use dark-mode for the menu"
+			L"  --dark-mode        Use dark-mode for the menu\n"
+			L"  --background-refresh  Show the cached menu at once, update the cache in the background\n"
+			L"  --live-refresh     Like --background-refresh, also update the open menu\n"
+			L"  --resident         Keep one stacky running that serves all stacks instantly\n"
+			L"  --shared-icons     Share extracted icons between stacks in %%LOCALAPPDATA%%\\stacky\n"
+			L"  --prefetch         Read the program of a hovered item ahead of the click\n"
+			L"  --custom-menu      Draw the menu with stacky's own popup instead of a native menu\n"
+			L"  --trace            Write phase timings to %%TEMP%%\\stacky-trace-<pid>.json"
 		);
 	}
 	else if (cmd_line_error == ERR_PATH_INVALID) {
@@ -1195,29 +3160,52 @@ int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, LPTSTR cmd_line, int) {
 			stack_path.c_str()
 		);
 	}
-	else if (!cache.scan()) {
-		Util::msgt(
-			err_title + L"Invalid path",
-			L"%s",
-			err_msg.c_str()
-		);
-	}
-	else if (!cache.load()) {
-		Util::msgt(
-			err_title + L"Failed to load stack cache",
-			L"%s",
-			err_msg.c_str()
-		);
+	else if (opts.find(L"--resident") != String::npos) {
+		// One resident stacky serves all stacks: hand the click over to it, or become it.
+		// The host loads every stack it serves itself.
+		if (!App::send_to_host(cmd_line)) {
+			App app(nullptr, opts);
+			if (!app.host(cmd_line)) {
+				Util::msgt(
+					err_title + L"Invalid path",
+					L"%s",
+					err_msg.c_str()
+				);
+			}
+			else
+				app.run();
+		}
 	}
-	else if (!app.init()) {
-		Util::msgt(
-			err_title + L"App init failed",
-			L"%s",
-			err_msg.c_str()
-		);
+	else {
+		Cache   cache(stack_path);
+		App     app(&cache, opts);
+		bool    cached = app.refresh_in_background() && cache.load_cached();
+
+		if (!cached && !cache.scan()) {
+			Util::msgt(
+				err_title + L"Invalid path",
+				L"%s",
+				err_msg.c_str()
+			);
+		}
+		else if (!cached && !cache.load()) {
+			Util::msgt(
+				err_title + L"Failed to load stack cache",
+				L"%s",
+				err_msg.c_str()
+			);
+		}
+		else if (!app.init(cached)) {
+			Util::msgt(
+				err_title + L"App init failed",
+				L"%s",
+				err_msg.c_str()
+			);
+		}
+		else
+			app.run();
 	}
-	else
-		app.run();
 
+	Trace::write();
 	return 0;
 }
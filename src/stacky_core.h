@@ -0,0 +1,1119 @@
+#pragma once
+
+/**************************************************************************************************
+ * Stacky core: cache format, stack scanning and menu tree.
+ * Plain C++17 without Win32, so it also builds on Linux (see bench/). stacky.cpp includes it after
+ * <windows.h> without NOMINMAX, so std::min and std::max are called as (std::min) and (std::max).
+ **************************************************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <new>
+#include <type_traits>
+
+
+/**************************************************************************************************
+ * Simple types and constants
+ **************************************************************************************************/
+typedef wchar_t                 Char;
+typedef unsigned char           Byte;
+typedef unsigned int            U32;    // DWORD-sized fields of the cache file
+typedef unsigned long long      U64;
+typedef unsigned long long      Hash;
+typedef std::wstring            String;
+typedef std::wstring_view       StringView;
+typedef std::vector<String>     StringList;
+
+const String CACHE_FILE_NAME = L"!stacky.cache";
+const Char* const DIR_SEP = L"\\";
+const String SUBMENU_SUFFIX = L".submenu";
+const String DESKTOP_INI = L"desktop.ini";
+const U32 CACHE_VERSION = 20;    // Increment this when cache format changes
+const size_t CACHE_ALIGN = 4;    // Cache records are padded so names and headers can be read in place
+
+// Icon sizes stored in the cache: a 16px menu icon at 100% to 300% scaling
+const U32 ICON_SIZES[] = { 16, 20, 24, 32, 48 };
+const size_t ICON_SIZE_COUNT = sizeof(ICON_SIZES) / sizeof(ICON_SIZES[0]);
+
+
+struct CoreUtil {
+
+	static String rtrim(const String& target, const String& trim) {
+		size_t cutoff_pos = target.size() - trim.size();
+		return target.rfind(trim) == cutoff_pos ? target.substr(0, cutoff_pos) : target;
+	}
+	static String ltrim(const String& target, const String& trim) {
+		size_t cutoff_pos = trim.size();
+		return target.find(trim) != String::npos ? target.substr(cutoff_pos) : target;
+	}
+	static String trim(const String& target, const String& trim) {
+		return rtrim(ltrim(target, trim), trim);
+	}
+	static String quote(const String& target) {
+		return L"\"" + target + L"\"";
+	}
+	static bool ends_with(const String& target, const String& ending)
+	{
+		if (target.length() >= ending.length())
+		{
+			return (0 == target.compare(target.length() - ending.length(), ending.length(), ending));
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	// Fast 64-bit content hash: FNV-1a over 64-bit words with a final avalanche.
+	// Not collision-proof, callers compare the bytes on a match.
+	struct Hasher {
+		Hash h;
+		Hasher() : h(0xcbf29ce484222325ULL) {}
+		void add(const void* data, size_t size) {
+			const Byte* p = (const Byte*)data;
+			for (; size >= sizeof(Hash); p += sizeof(Hash), size -= sizeof(Hash)) {
+				Hash w;
+				memcpy(&w, p, sizeof(Hash));
+				h = (h ^ w) * 0x100000001b3ULL;
+			}
+			for (; size; p++, size--) {
+				h = (h ^ *p) * 0x100000001b3ULL;
+			}
+		}
+		Hash value() const {
+			Hash v = h;
+			v ^= v >> 33; v *= 0xff51afd7ed558ccdULL;
+			v ^= v >> 33; v *= 0xc4ceb9fe1a85ec53ULL;
+			v ^= v >> 33;
+			return v;
+		}
+	};
+};
+
+struct Buffer {
+	size_t  capacity, size;
+	Byte* data;
+
+	Buffer() : capacity(0), size(0), data(0) {}
+	~Buffer() {}
+
+	void free() {
+		if (data) {
+			delete[] data;
+			data = 0;
+		}
+		capacity = size = 0;
+	}
+	bool load(const String& str, bool append_null) {
+		load(str.c_str(), str.size() * sizeof(Char));
+		if (append_null) {
+			Char str_end[1] = { 0 };
+			load(str_end, sizeof(Char));
+		}
+		return true;
+	}
+	bool load(const void* src, size_t src_size) {
+		grow(src_size + size);
+		memcpy(data + size, src, src_size);
+		size += src_size;
+		return true;
+	}
+	void align(size_t alignment) {
+		static const Byte zeros[16] = { 0 };
+		size_t padding = (alignment - size % alignment) % alignment;
+		load(zeros, padding);
+	}
+	bool load(const String& file_path) {
+		FileWrap f(file_path, L"rb");
+		if (!f.is_open()) {
+			return false;
+		}
+		size_t file_size = f.size();
+		if (!file_size) {
+			return false;
+		}
+		grow(file_size + size);
+		f.read(data + size, file_size);
+		size += file_size;
+		return true;
+	}
+	bool save(const String& file_path) {
+		FileWrap f(file_path, L"wb");
+		if (!f.is_open()) {
+			return false;
+		}
+		return f.write(data, size) == size;
+	}
+
+private:
+	struct FileWrap {
+		FILE* f;
+		FileWrap(const String& path, const String& mode) { f = open(path, mode); }
+		~FileWrap() { f&& fclose(f); f = 0; }
+		bool    is_open() { return f != 0; }
+		size_t  write(Byte* data, size_t size) { return fwrite(data, 1, size, f); }
+		size_t  read(Byte* data, size_t size) { return fread(data, 1, size, f); }
+		size_t  size() {
+			fseek(f, 0L, SEEK_END);
+			size_t file_size = ftell(f);
+			fseek(f, 0L, SEEK_SET);
+			return file_size;
+		}
+		static FILE* open(const String& path, const String& mode) {
+#ifdef _WIN32
+			return _wfopen(path.c_str(), mode.c_str());
+#else
+			std::string narrow_path(path.size() * MB_CUR_MAX + 1, '\0');
+			std::string narrow_mode(mode.begin(), mode.end());
+			size_t len = wcstombs(&narrow_path[0], path.c_str(), narrow_path.size());
+			if (len == (size_t)-1) return 0;
+			narrow_path.resize(len);
+			return fopen(narrow_path.c_str(), narrow_mode.c_str());
+#endif
+		}
+	};
+	void grow(size_t new_capacity) {
+		if (capacity >= new_capacity) {
+			return;
+		}
+		size_t new_cap = capacity ? capacity : 256;
+		while (new_cap < new_capacity) {
+			new_cap *= 2;
+		}
+		Byte* new_data = new Byte[new_cap];
+		if (data) {
+			memcpy(new_data, data, size);
+			delete[] data;
+		}
+		data = new_data;
+		capacity = new_cap;
+	}
+};
+
+// Bump allocation for data that dies together, e.g. what one menu session builds. reset() frees all of
+// it at once and keeps the blocks, so later sessions do not allocate. Only for trivially destructible types.
+struct Arena {
+	enum { BLOCK_SIZE = 64 * 1024 };
+
+	Arena() : allocations(0), block(0), used(0) {}
+	~Arena() {
+		for (Block& b : blocks) delete[] b.data;
+	}
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* alloc(size_t size, size_t alignment) {
+		for (;;) {
+			if (block < blocks.size()) {
+				size_t pos = (used + alignment - 1) & ~(alignment - 1);
+				if (pos + size <= blocks[block].size) {
+					used = pos + size;
+					return blocks[block].data + pos;
+				}
+				block++;
+				used = 0;
+				continue;
+			}
+			size_t block_size = (std::max)((size_t)BLOCK_SIZE, size + alignment);
+			blocks.push_back(Block{ new Byte[block_size], block_size });
+			allocations++;
+		}
+	}
+	template <typename T>
+	T* make() {
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+		return new (alloc(sizeof(T), alignof(T))) T();
+	}
+	// Null-terminated copy of `text`, for APIs that want C strings
+	StringView intern(StringView text) {
+		Char* copy = (Char*)alloc((text.size() + 1) * sizeof(Char), alignof(Char));
+		memcpy(copy, text.data(), text.size() * sizeof(Char));
+		copy[text.size()] = 0;
+		return StringView(copy, text.size());
+	}
+	void reset() {
+		block = 0;
+		used = 0;
+	}
+
+	size_t allocations;     // blocks allocated so far
+
+private:
+	struct Block {
+		Byte*   data;
+		size_t  size;
+	};
+	std::vector<Block> blocks;
+	size_t  block;  // block being filled
+	size_t  used;
+};
+
+// Read-only bytes of a cache file with bounds-checked readers
+struct ByteView {
+	const Byte* data;
+	size_t      size;
+
+	ByteView() : data(0), size(0) {}
+	ByteView(const Byte* bytes, size_t byte_count) : data(bytes), size(byte_count) {}
+
+	// Null-terminated string at `pos`, served in place
+	bool read_string(size_t& pos, StringView& str) const {
+		if (pos >= size) {
+			return false;
+		}
+		const Char* s = (const Char*)(data + pos);
+		size_t max_len = (size - pos) / sizeof(Char);
+		size_t len = wcsnlen(s, max_len);
+		if (len == max_len) {
+			return false;
+		}
+		str = StringView(s, len);
+		pos += (len + 1) * sizeof(Char);
+		return true;
+	}
+	bool read(size_t& pos, void* dst, size_t dst_size) const {
+		if (pos > size || size - pos < dst_size) {
+			return false;
+		}
+		memcpy(dst, data + pos, dst_size);
+		pos += dst_size;
+		return true;
+	}
+	static size_t align(size_t pos) {
+		return (pos + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+	}
+};
+
+
+/**************************************************************************************************
+ * File system access used by the stack scan
+ **************************************************************************************************/
+struct DirEntry {
+	String  name;
+	U64     size;
+	U64     write_time;     // 100ns ticks, FILETIME on Windows
+	bool    is_directory;
+	bool    is_hidden;
+};
+
+struct FileSystem {
+	virtual ~FileSystem() {}
+	// Appends the entries of `dir` (ending with DIR_SEP), without "." and "..". False if it cannot be listed.
+	virtual bool list(const String& dir, std::vector<DirEntry>& entries) = 0;
+};
+
+
+/**************************************************************************************************
+ * Icon codec: lossless and byte oriented, after QOI. Icons are mostly transparent runs and smooth
+ * shading, which it packs to a fraction of their raw 32bpp size in a single pass each way.
+ **************************************************************************************************/
+struct IconCodec {
+	enum {
+		OP_INDEX = 0x00,    // 00iiiiii: pixel from the table of recently seen ones
+		OP_DIFF = 0x40,     // 01rrggbb: small change of b, g and r, same alpha
+		OP_LUMA = 0x80,     // 10gggggg rrrrbbbb: change of g, with r and b relative to it
+		OP_RUN = 0xc0,      // 11nnnnnn: previous pixel repeated 1..62 times
+		OP_RGB = 0xfe,      // b g r, same alpha
+		OP_RGBA = 0xff,     // b g r a
+		OP_MASK = 0xc0,
+		MAX_RUN = 62,
+	};
+
+	// Worst case output size for `count` pixels
+	static size_t max_size(size_t count) {
+		return count * 5;
+	}
+
+	// Packs `count` BGRA pixels into `out`, which holds max_size(count) bytes. Returns the bytes written.
+	static size_t encode(const Byte* pixels, size_t count, Byte* out) {
+		U32 index[64] = { 0 };
+		U32 prev = 0;       // transparent black, so icons start with a run
+		size_t run = 0;
+		Byte* o = out;
+		for (size_t i = 0; i < count; i++) {
+			U32 px;
+			memcpy(&px, pixels + i * 4, 4);
+			if (px == prev) {
+				if (++run == MAX_RUN) {
+					*o++ = (Byte)(OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run) {
+				*o++ = (Byte)(OP_RUN | (run - 1));
+				run = 0;
+			}
+			size_t h = hash(px);
+			if (index[h] == px) {
+				*o++ = (Byte)(OP_INDEX | h);
+			}
+			else {
+				index[h] = px;
+				const Byte* c = pixels + i * 4;
+				const Byte* p = (const Byte*)&prev;
+				if (c[3] == p[3]) {
+					signed char db = (signed char)(c[0] - p[0]), dg = (signed char)(c[1] - p[1]), dr = (signed char)(c[2] - p[2]);
+					signed char dr_dg = (signed char)(dr - dg), db_dg = (signed char)(db - dg);
+					if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+						*o++ = (Byte)(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+					}
+					else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+						*o++ = (Byte)(OP_LUMA | (dg + 32));
+						*o++ = (Byte)((dr_dg + 8) << 4 | (db_dg + 8));
+					}
+					else {
+						*o++ = OP_RGB;
+						memcpy(o, c, 3);
+						o += 3;
+					}
+				}
+				else {
+					*o++ = OP_RGBA;
+					memcpy(o, c, 4);
+					o += 4;
+				}
+			}
+			prev = px;
+		}
+		if (run) {
+			*o++ = (Byte)(OP_RUN | (run - 1));
+		}
+		return o - out;
+	}
+
+	// Unpacks exactly `count` pixels from exactly `size` bytes, false for anything malformed
+	static bool decode(const Byte* data, size_t size, Byte* pixels, size_t count) {
+		return decode(data, size, pixels, count, 1, count * 4);
+	}
+	// Same as `height` rows of `width` pixels that start `stride` bytes apart, e.g. straight into a cell of
+	// a larger bitmap
+	static bool decode(const Byte* data, size_t size, Byte* pixels, size_t width, size_t height, size_t stride) {
+		U32 index[64] = { 0 };
+		Byte px[4] = { 0, 0, 0, 0 };   // b g r a
+		const Byte* p = data;
+		const Byte* end = data + size;
+		Byte* row = pixels;
+		Byte* o = row;
+		Byte* o_end = row + width * 4;  // end of the current row
+		size_t rows_left = height;
+		size_t left = width * height;
+		while (left) {
+			if (p == end) {
+				return false;
+			}
+			Byte op = *p++;
+			if (op == OP_RGB || op == OP_RGBA) {
+				size_t bytes = op == OP_RGB ? 3 : 4;
+				if ((size_t)(end - p) < bytes) {
+					return false;
+				}
+				memcpy(px, p, bytes);
+				p += bytes;
+			}
+			else if ((op & OP_MASK) == OP_RUN) {
+				size_t n = (op & 0x3f) + 1;
+				if (n > left) {
+					return false;
+				}
+				// Row by row, a run can go on past the end of one
+				for (left -= n; n; ) {
+					size_t span = (std::min)(n, (size_t)(o_end - o) / 4);
+					for (n -= span; span; span--, o += 4) memcpy(o, px, 4);
+					if (o == o_end && --rows_left) {
+						row += stride;
+						o = row;
+						o_end = row + width * 4;
+					}
+				}
+				continue;
+			}
+			else if ((op & OP_MASK) == OP_INDEX) {
+				memcpy(px, &index[op], 4);
+			}
+			else if ((op & OP_MASK) == OP_DIFF) {
+				px[2] += ((op >> 4) & 3) - 2;
+				px[1] += ((op >> 2) & 3) - 2;
+				px[0] += (op & 3) - 2;
+			}
+			else {
+				if (p == end) {
+					return false;
+				}
+				Byte rb = *p++;
+				int dg = (op & 0x3f) - 32;
+				px[1] += dg;
+				px[2] += dg + (rb >> 4) - 8;
+				px[0] += dg + (rb & 0x0f) - 8;
+			}
+			U32 v;
+			memcpy(&v, px, 4);
+			index[hash(v)] = v;
+			memcpy(o, px, 4);
+			o += 4;
+			left--;
+			if (o == o_end && --rows_left) {
+				row += stride;
+				o = row;
+				o_end = row + width * 4;
+			}
+		}
+		return p == end;
+	}
+
+private:
+	static size_t hash(U32 px) {
+		return ((px & 0xff) * 7 + (px >> 8 & 0xff) * 5 + (px >> 16 & 0xff) * 3 + (px >> 24) * 11) & 63;
+	}
+};
+
+
+/**************************************************************************************************
+ * Cache core: the file format and the stack model, without icons
+ **************************************************************************************************/
+struct CacheCore {
+
+	// File layout: Header | Group[group_count] | Entry[item_count] | U32 icon offsets | icon data | item records |
+	// search text.
+	// Entries are grouped by parent folder, so one folder's records can be decoded on their own.
+	// Group 0 is the stack root and also holds the base folder item (item 0).
+	// Icons are stored once per distinct image and referred to by index, in every ICON_SIZES size, encoded
+	// by IconCodec. Icon i at size s is the data between offsets s * icon_count + i and the next one.
+	// The search text ends the file: every item's label, normalized, each followed by '\n' (see SearchIndex).
+	struct Header {
+		U32     version;
+		U32     item_count;
+		U32     group_count;
+		U32     icon_sizes; // ICON_SIZE_COUNT
+		U32     icon_count;
+		U32     search_chars;   // length of the search text
+		Hash    fingerprint;    // of the scan the cache was built from, see scan()
+	};
+	struct Group {
+		U32     first;  // range in the entry table
+		U32     count;
+	};
+	struct Entry {
+		U32     item;   // item index (scan order)
+		U32     offset; // record offset in the file
+	};
+
+	// A string of the pool: `length` chars from `pos`
+	struct StrRef {
+		U32     pos;
+		U32     length;
+	};
+	struct Stamp {
+		U64     size;   // identity of the entry the icon was extracted from
+		U64     write_time;
+	};
+	// What a shortcut launches, resolved by the rebuild. Only items with a target have one.
+	struct Target {
+		StrRef  target;
+		StrRef  arguments;
+		StrRef  work_dir;
+		U32     show_cmd;
+	};
+	// One item as stored in the file, its strings read in place
+	struct Record {
+		StringView      name;
+		StringView      target;     // empty to launch the file itself
+		StringView      arguments;
+		StringView      work_dir;
+		U32             flags;
+		U32             group;
+		U32             icon;
+		unsigned short  label_start;    // menu text is name[label_start, +label_length]
+		unsigned short  label_length;
+		Stamp           stamp;
+		U32             show_cmd;
+	};
+	enum { FLAG_SUBMENU = 1, FLAG_SEPARATOR = 2 };
+	static constexpr U32 NO_TARGET = (U32)-1;
+
+	// Record layout: name\0 | target\0 | arguments\0 | work_dir\0 | pad | U32 flags | U32 group | U32 icon |
+	// U16 label start | U16 label length | U64 size | U64 write_time | U32 show_cmd
+	static void write_record(Buffer& buffer, const Record& record) {
+		for (StringView str : { record.name, record.target, record.arguments, record.work_dir }) {
+			buffer.load(str.data(), str.size() * sizeof(Char));
+			buffer.load(L"", sizeof(Char));
+		}
+		buffer.align(CACHE_ALIGN);
+		unsigned short label_range[2] = { record.label_start, record.label_length };
+		buffer.load(&record.flags, sizeof(record.flags));
+		buffer.load(&record.group, sizeof(record.group));
+		buffer.load(&record.icon, sizeof(record.icon));
+		buffer.load(label_range, sizeof(label_range));
+		buffer.load(&record.stamp.size, sizeof(record.stamp.size));
+		buffer.load(&record.stamp.write_time, sizeof(record.stamp.write_time));
+		buffer.load(&record.show_cmd, sizeof(record.show_cmd));
+	}
+	// A submenu's group has to be below `group_count`: menus index groups with it before decoding them
+	static bool read_record(const ByteView& file, size_t& pos, U32 group_count, Record& record) {
+		if (!file.read_string(pos, record.name) || !file.read_string(pos, record.target) || !file.read_string(pos, record.arguments) || !file.read_string(pos, record.work_dir)) {
+			return false;
+		}
+		pos = ByteView::align(pos);
+
+		unsigned short label_range[2] = { 0 };
+		if (!file.read(pos, &record.flags, sizeof(record.flags)) || !file.read(pos, &record.group, sizeof(record.group)) || !file.read(pos, &record.icon, sizeof(record.icon)) ||
+			!file.read(pos, label_range, sizeof(label_range)) || !file.read(pos, &record.stamp.size, sizeof(record.stamp.size)) || !file.read(pos, &record.stamp.write_time, sizeof(record.stamp.write_time)) ||
+			!file.read(pos, &record.show_cmd, sizeof(record.show_cmd))) {
+			return false;
+		}
+		if (label_range[0] > record.name.size() || label_range[1] > record.name.size() - label_range[0]) {
+			return false;
+		}
+		if ((record.flags & FLAG_SUBMENU) && record.group >= group_count) {
+			return false;
+		}
+		record.flags &= FLAG_SUBMENU | FLAG_SEPARATOR;
+		record.label_start = label_range[0];
+		record.label_length = label_range[1];
+		return true;
+	}
+
+	// The item table: parallel arrays indexed by item, so a menu walk or a rebuild reads only the columns it
+	// needs. Strings are offsets into one pool: the mapped cache file, or string_pool after a rebuild.
+	std::vector<StrRef> names;          // path relative to base_dir; the base folder item has its full path
+	std::vector<StrRef> labels;         // menu text, a part of the name, resolved by build_index(); empty for separators
+	std::vector<U32>    parents;        // group listing the item
+	std::vector<U32>    child_groups;   // group holding the children of a submenu
+	std::vector<int>    slots;          // icon index, which is also its slot in the cache's atlas; -1 until decoded
+	std::vector<Byte>   flags;          // FLAG_SUBMENU, FLAG_SEPARATOR
+	std::vector<U32>    target_ids;     // index in targets, NO_TARGET to launch the item itself
+	std::vector<Target> targets;        // shortcuts only
+	std::vector<Stamp>  stamps;         // filled by scans only, empty for a loaded cache
+	std::vector<Group>  groups;
+	std::vector<Entry>  entries;
+	String              base_dir;
+	StringView          pool;
+	StringView          search_text;    // points into the cache file, or into search_data after a rebuild
+
+	CacheCore(const String& stack_path) : base_write_time(0), scanned_chars(0), scanned_fingerprint(0), cached_fingerprint(0), icons_pos(0), stored_icons(0) {
+		base_dir = base_dir_of(stack_path);
+	}
+
+	// The stack folder of a command line path, with a trailing separator
+	static String base_dir_of(const String& stack_path) {
+		return CoreUtil::trim(CoreUtil::rtrim(stack_path, DIR_SEP), L"\"") + DIR_SEP;
+	}
+
+	String path(StringView file = StringView()) const {
+		return String(base_dir).append(file);
+	}
+	// Same into a string the caller reuses, for loops over many items
+	const String& path(StringView file, String& out) const {
+		return out.assign(base_dir).append(file);
+	}
+
+	size_t item_count() const {
+		return names.size();
+	}
+	StringView str(StrRef ref) const {
+		return StringView(pool.data() + ref.pos, ref.length);
+	}
+	StringView name(size_t item) const {
+		return str(names[item]);
+	}
+	StringView label(size_t item) const {
+		return str(labels[item]);
+	}
+	bool is_submenu(size_t item) const {
+		return (flags[item] & FLAG_SUBMENU) != 0;
+	}
+	bool is_separator(size_t item) const {
+		return (flags[item] & FLAG_SEPARATOR) != 0;
+	}
+	// What the item launches, null to launch the item itself
+	const Target* target(size_t item) const {
+		return target_ids[item] == NO_TARGET ? nullptr : &targets[target_ids[item]];
+	}
+	// Gives a rebuilt item its shortcut target; the strings are copied into the pool
+	void set_target(size_t item, StringView target, StringView arguments, StringView work_dir, U32 show_cmd) {
+		if (target.empty()) {
+			return;
+		}
+		target_ids[item] = (U32)targets.size();
+		targets.push_back(Target{ pool_string(target), pool_string(arguments), pool_string(work_dir), show_cmd });
+	}
+	// Heap bytes of the item table, strings aside: those stay in the file or the pool
+	size_t item_table_bytes() const {
+		return names.capacity() * sizeof(StrRef) + labels.capacity() * sizeof(StrRef) + parents.capacity() * sizeof(U32) +
+			child_groups.capacity() * sizeof(U32) + slots.capacity() * sizeof(int) + flags.capacity() + target_ids.capacity() * sizeof(U32) +
+			targets.capacity() * sizeof(Target) + stamps.capacity() * sizeof(Stamp);
+	}
+
+	// One enumeration pass collects the entries and the stack fingerprint: an order-independent sum of
+	// per-entry hashes over name, size and 100ns write time. No per-file stat calls.
+	bool scan(FileSystem& fs) {
+		scanned_items.clear();
+		// The base folder item's name first, then every scanned name
+		string_pool = CoreUtil::rtrim(path(), DIR_SEP);
+		base_write_time = 0;
+		scanned_fingerprint = 0;
+		if (!scan_directory(fs, base_dir, L"", NO_FOLDER)) {
+			return false;
+		}
+		scanned_chars = string_pool.size();
+		CoreUtil::Hasher hasher;
+		hasher.add(&scanned_fingerprint, sizeof(scanned_fingerprint));
+		size_t count = scanned_items.size();
+		hasher.add(&count, sizeof(count));
+		scanned_fingerprint = hasher.value();
+		return true;
+	}
+
+	size_t scanned_count() const {
+		return scanned_items.size();
+	}
+
+	bool is_outdated() const {
+		return cached_fingerprint != scanned_fingerprint;
+	}
+
+	// Fills items from the last scan, item 0 being the base folder. Icons and targets are left to the caller.
+	void add_scanned_items() {
+		// Targets of an earlier rebuild from the same scan go
+		string_pool.resize(scanned_chars);
+		pool = string_pool;
+		size_t count = scanned_items.size() + 1;
+		clear_items(count);
+		stamps.resize(count);
+		names[0] = StrRef{ 0, (U32)CoreUtil::rtrim(path(), DIR_SEP).size() };
+		stamps[0] = Stamp{ 0, base_write_time };
+		for (size_t i = 1; i < count; i++) {
+			const ScanEntry& scanned = scanned_items[i - 1];
+			names[i] = StrRef{ (U32)scanned.name_pos, scanned.name_length };
+			stamps[i] = Stamp{ scanned.size, scanned.write_time };
+		}
+	}
+
+	// Groups items by parent folder and resolves menu labels. Scan order lists a submenu before its children.
+	void build_index() {
+		parents.assign(item_count(), 0);
+		std::unordered_map<StringView, U32> folder_groups;
+		groups.assign(1, Group{ 0, 0 });
+		for (size_t i = 1; i < item_count(); i++) {
+			StringView item_name = name(i);
+			size_t sep_pos = item_name.rfind(DIR_SEP);
+			if (sep_pos != StringView::npos) {
+				auto it = folder_groups.find(item_name.substr(0, sep_pos));
+				parents[i] = it != folder_groups.end() ? it->second : 0;
+			}
+			if (is_submenu(i)) {
+				child_groups[i] = (U32)groups.size();
+				folder_groups[item_name] = child_groups[i];
+				groups.push_back(Group{ 0, 0 });
+			}
+		}
+
+		// Menu building then only copies labels: no path splitting or extension stripping per open
+		for (size_t i = 1; i < item_count(); i++) {
+			StringView item_name = name(i);
+			size_t sep_pos = item_name.rfind(DIR_SEP);
+			StringView rel = sep_pos == StringView::npos ? item_name : item_name.substr(sep_pos + 1);
+			bool separator = is_separator_file(rel);
+			flags[i] = (Byte)((flags[i] & FLAG_SUBMENU) | (separator ? FLAG_SEPARATOR : 0));
+			labels[i] = separator ? StrRef{ names[i].pos, 0 } : ref(menu_label(rel, is_submenu(i), parents[i] == 0));
+		}
+
+		// Counting sort by group keeps scan order inside each group
+		for (U32 parent : parents) groups[parent].count++;
+		for (size_t g = 1; g < groups.size(); g++) groups[g].first = groups[g - 1].first + groups[g - 1].count;
+		std::vector<U32> fill(groups.size(), 0);
+		entries.resize(item_count());
+		for (size_t i = 0; i < item_count(); i++) {
+			U32 g = parents[i];
+			entries[groups[g].first + fill[g]++] = Entry{ (U32)i, 0 };
+		}
+		group_loaded.assign(groups.size(), true);
+	}
+
+	// Writes the whole file for the scanned stack. `icon_pixels(size_index, icon)` returns the BGRA pixels of
+	// an icon at ICON_SIZES[size_index].
+	template <typename IconPixels>
+	void serialize(Buffer& buffer, U32 icon_count, IconPixels icon_pixels) {
+		// Icons first, then records group by group, so decoding one folder reads one contiguous run
+		build_search_text();
+		Header header = { CACHE_VERSION, (U32)item_count(), (U32)groups.size(), (U32)ICON_SIZE_COUNT, icon_count, (U32)search_text.size(), scanned_fingerprint };
+		std::vector<U32> offsets;
+		Buffer icons;
+		encode_icons(icon_count, icon_pixels, offsets, icons);
+		icons_pos = sizeof(Header) + groups.size() * sizeof(Group) + entries.size() * sizeof(Entry);
+		stored_icons = icon_count;
+		size_t records_pos = icons_pos + offsets.size() * sizeof(U32) + icons.size;
+		Buffer records;
+		for (Entry& e : entries) {
+			e.offset = (U32)(records_pos + records.size);
+			write_record(records, record(e.item));
+		}
+		buffer.load(&header, sizeof(Header));
+		buffer.load(groups.data(), groups.size() * sizeof(Group));
+		buffer.load(entries.data(), entries.size() * sizeof(Entry));
+		buffer.load(offsets.data(), offsets.size() * sizeof(U32));
+		buffer.load(icons.data, icons.size);
+		buffer.load(records.data, records.size);
+		buffer.load(search_text.data(), search_text.size() * sizeof(Char));
+		icons.free();
+		records.free();
+	}
+
+	// Reads and checks the header and the index. Records are decoded per group by decode_group().
+	bool read_index(const ByteView& file, Header& header) {
+		clear_items(0);
+		size_t pos = 0;
+		if (!file.read(pos, &header, sizeof(Header)) || header.version != CACHE_VERSION) {
+			return false;
+		}
+		if (header.item_count < 1 || header.group_count < 1 || header.item_count > file.size / sizeof(Entry) || header.group_count > file.size / sizeof(Group)) {
+			return false;
+		}
+		// The file is the pool of the loaded items, their strings are addressed by U32 offsets
+		if (file.size / sizeof(Char) > (U32)-1) {
+			return false;
+		}
+		if (header.icon_sizes != ICON_SIZE_COUNT || header.icon_count < 1 || header.icon_count > header.item_count) {
+			return false;
+		}
+		groups.resize(header.group_count);
+		entries.resize(header.item_count);
+		if (!file.read(pos, groups.data(), groups.size() * sizeof(Group)) || !file.read(pos, entries.data(), entries.size() * sizeof(Entry))) {
+			return false;
+		}
+		// The offset table has to fit; each icon's range is checked when it is read
+		icons_pos = pos;
+		if ((file.size - icons_pos) / sizeof(U32) <= (size_t)header.icon_count * ICON_SIZE_COUNT) {
+			return false;
+		}
+		stored_icons = header.icon_count;
+		size_t search_bytes = (size_t)header.search_chars * sizeof(Char);
+		if (search_bytes > file.size - icons_pos) {
+			return false;
+		}
+		search_text = StringView((const Char*)(file.data + file.size - search_bytes), header.search_chars);
+		for (const Group& g : groups) if (g.first > entries.size() || g.count > entries.size() - g.first) {
+			return false;
+		}
+		for (const Entry& e : entries) if (e.item >= entries.size()) {
+			return false;
+		}
+
+		pool = StringView((const Char*)file.data, file.size / sizeof(Char));
+		clear_items(entries.size());
+		stamps.clear();
+		for (U32 g = 0; g < groups.size(); g++) {
+			for (U32 k = groups[g].first; k < groups[g].first + groups[g].count; k++) parents[entries[k].item] = g;
+		}
+		group_loaded.assign(groups.size(), false);
+		cached_fingerprint = header.fingerprint;
+		return true;
+	}
+
+	// Decodes the records of one group, adding the bytes read to `bytes_read`
+	bool decode_group(const ByteView& file, U32 group, size_t& bytes_read) {
+		const Group& g = groups[group];
+		for (U32 i = g.first; i < g.first + g.count; i++) {
+			size_t pos = entries[i].offset;
+			Record record;
+			if (!read_record(file, pos, (U32)groups.size(), record)) {
+				return false;
+			}
+			store(entries[i].item, record);
+			bytes_read += pos - entries[i].offset;
+		}
+		return true;
+	}
+
+	static size_t icon_bytes(U32 icon_size) {
+		return (size_t)icon_size * icon_size * 4;
+	}
+	// One icon in all stored sizes, smallest first
+	static size_t icon_set_bytes() {
+		return icon_set_offset(ICON_SIZE_COUNT);
+	}
+	static size_t icon_set_offset(size_t size_index) {
+		size_t offset = 0;
+		for (size_t s = 0; s < size_index; s++) {
+			offset += icon_bytes(ICON_SIZES[s]);
+		}
+		return offset;
+	}
+	// Decodes one icon at ICON_SIZES[size_index] into rows `stride` bytes apart, 0 for packed rows. Adds the
+	// bytes read to `bytes_read`.
+	bool read_icon(const ByteView& file, size_t size_index, U32 icon, Byte* pixels, size_t stride, size_t& bytes_read) const {
+		if (icon >= stored_icons || size_index >= ICON_SIZE_COUNT) {
+			return false;
+		}
+		U32 range[2];
+		size_t pos = icons_pos + (size_index * stored_icons + icon) * sizeof(U32);
+		if (!file.read(pos, range, sizeof(range)) || range[1] < range[0]) {
+			return false;
+		}
+		size_t data_pos = icons_pos + ((size_t)stored_icons * ICON_SIZE_COUNT + 1) * sizeof(U32) + range[0];
+		size_t data_size = range[1] - range[0];
+		if (data_pos > file.size || file.size - data_pos < data_size) {
+			return false;
+		}
+		bytes_read += data_size + sizeof(range);
+		size_t size = ICON_SIZES[size_index];
+		return IconCodec::decode(file.data + data_pos, data_size, pixels, size, size, stride ? stride : size * 4);
+	}
+	// The stored size to draw `wanted` pixel icons with: the largest that fits, so nothing gets resampled
+	static size_t icon_size_index(U32 wanted) {
+		size_t index = 0;
+		for (size_t s = 1; s < ICON_SIZE_COUNT; s++) {
+			if (ICON_SIZES[s] <= wanted) index = s;
+		}
+		return index;
+	}
+
+	static bool is_separator_file(StringView name) {
+		// handle ".separator" and ".separator.lnk"
+		StringView base = strip(name, L".lnk");
+		return strip(base, L".separator").size() != base.size();
+	}
+
+	// Menu text for a file or folder name, a prefix of it. The root menu hides a few more extensions than submenus.
+	static StringView menu_label(StringView name, bool is_submenu, bool in_root) {
+		if (is_submenu) {
+			return strip(name, SUBMENU_SUFFIX);
+		}
+		if (in_root) {
+			for (const Char* ext : { L".bat", L".cmd", L".exe", L".lnk", L".url", L".vbs" }) name = strip(name, ext);
+		}
+		else {
+			for (const Char* ext : { L".lnk", L".vbs", L".cmd", L".bat" }) name = strip(name, ext);
+		}
+		return name;
+	}
+
+	// Search form of a label or query: lowercase, so typing matches regardless of case
+	static String normalize(StringView text) {
+		String out(text);
+		for (Char& c : out) c = (Char)std::towlower(c);
+		return out;
+	}
+
+	// `name` without `suffix`, if it ends with it
+	static StringView strip(StringView name, StringView suffix) {
+		bool ends = name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+		return ends ? name.substr(0, name.size() - suffix.size()) : name;
+	}
+
+protected:
+	// One directory entry as seen by scan(); size and write time identify the content its icon came from
+	struct ScanEntry {
+		size_t      name_pos;   // path relative to base_dir, in string_pool
+		U32         name_length;
+		U64         size;
+		U64         write_time; // 100ns FILETIME
+	};
+	static const size_t NO_FOLDER = (size_t)-1;
+
+	U64         base_write_time;
+	std::vector<ScanEntry> scanned_items;
+	String      string_pool;    // the base folder's path and all scanned names, then the targets of a rebuild
+	size_t      scanned_chars;  // pool size after the scan
+	Hash        scanned_fingerprint;
+	Hash        cached_fingerprint;
+	std::vector<bool> group_loaded;
+	size_t      icons_pos;      // offset of the icon offset table in the cache file
+	U32         stored_icons;   // icon_count of the cache file
+	String      search_data;
+
+	// One line per item in item order, so a match position maps back to its item. Separators, the base
+	// folder item and labels with a line break stay empty.
+	void build_search_text() {
+		search_data.clear();
+		for (size_t i = 0; i < item_count(); i++) {
+			StringView label = this->label(i);
+			if (i > 0 && label.find(L'\n') == StringView::npos) search_data += normalize(label);
+			search_data += L'\n';
+		}
+		search_text = search_data;
+	}
+
+	// Encodes every icon in every size, size by size, and the offset table over the result
+	template <typename IconPixels>
+	static void encode_icons(U32 icon_count, IconPixels icon_pixels, std::vector<U32>& offsets, Buffer& icons) {
+		std::vector<Byte> encoded(IconCodec::max_size(ICON_SIZES[ICON_SIZE_COUNT - 1] * ICON_SIZES[ICON_SIZE_COUNT - 1]));
+		offsets.reserve((size_t)icon_count * ICON_SIZE_COUNT + 1);
+		for (size_t s = 0; s < ICON_SIZE_COUNT; s++) {
+			for (U32 icon = 0; icon < icon_count; icon++) {
+				offsets.push_back((U32)icons.size);
+				size_t n = IconCodec::encode(icon_pixels(s, icon), ICON_SIZES[s] * ICON_SIZES[s], encoded.data());
+				icons.load(encoded.data(), n);
+			}
+		}
+		offsets.push_back((U32)icons.size);
+		// Records are read in place, keep them aligned
+		icons.align(CACHE_ALIGN);
+	}
+
+	// `folder` is the scanned_items index of the .submenu being scanned, NO_FOLDER for the base folder
+	bool scan_directory(FileSystem& fs, const String& dir_path, const String& relative_path, size_t folder) {
+		std::vector<DirEntry> listing;
+		if (!fs.list(dir_path, listing)) {
+			return false;
+		}
+		for (const DirEntry& d : listing) {
+			const String& filename = d.name;
+			if (filename == DESKTOP_INI) {
+				// A custom folder icon lives in desktop.ini, so it is part of the folder's identity
+				U64& folder_time = folder == NO_FOLDER ? base_write_time : scanned_items[folder].write_time;
+				folder_time = (std::max)(folder_time, d.write_time);
+				scanned_fingerprint += entry_hash(relative_path + filename, d.size, d.write_time);
+				continue;
+			}
+			// The cache's own .tmp and .old files too, should one have lost its hidden attribute
+			if (d.is_hidden || CoreUtil::ends_with(filename, L".ignore") || filename.compare(0, CACHE_FILE_NAME.size(), CACHE_FILE_NAME) == 0)
+				continue;
+
+			// The pool may move as it grows, so entries keep offsets and views are made by add_scanned_items()
+			size_t name_pos = string_pool.size();
+			string_pool.append(relative_path).append(filename);
+			StringView full_filename = StringView(string_pool).substr(name_pos);
+			scanned_fingerprint += entry_hash(full_filename, d.size, d.write_time);
+			scanned_items.push_back(ScanEntry{ name_pos, (U32)full_filename.size(), d.size, d.write_time });
+
+			// If this is a .submenu folder, recursively scan it
+			if (d.is_directory && CoreUtil::ends_with(filename, SUBMENU_SUFFIX)) {
+				scan_directory(fs, dir_path + filename + DIR_SEP, String(full_filename) + DIR_SEP, scanned_items.size() - 1);
+			}
+		}
+		return true;
+	}
+	// `count` items with nothing decoded or built yet
+	void clear_items(size_t count) {
+		names.assign(count, StrRef{ 0, 0 });
+		labels.assign(count, StrRef{ 0, 0 });
+		parents.assign(count, 0);
+		child_groups.assign(count, 0);
+		slots.assign(count, -1);
+		flags.assign(count, 0);
+		target_ids.assign(count, NO_TARGET);
+		targets.clear();
+	}
+	// A view into the pool as an offset
+	StrRef ref(StringView str) const {
+		return StrRef{ (U32)(str.data() - pool.data()), (U32)str.size() };
+	}
+	// Appends to the pool of a rebuilt cache, which may move it
+	StrRef pool_string(StringView str) {
+		StrRef r = { (U32)string_pool.size(), (U32)str.size() };
+		string_pool.append(str);
+		pool = string_pool;
+		return r;
+	}
+	// Puts a decoded record into the table; its strings stay in the file, which is the pool
+	void store(U32 item, const Record& record) {
+		names[item] = ref(record.name);
+		labels[item] = StrRef{ names[item].pos + record.label_start, record.label_length };
+		child_groups[item] = (record.flags & FLAG_SUBMENU) ? record.group : 0;
+		slots[item] = (int)record.icon;
+		flags[item] = (Byte)record.flags;
+		if (!record.target.empty()) {
+			target_ids[item] = (U32)targets.size();
+			targets.push_back(Target{ ref(record.target), ref(record.arguments), ref(record.work_dir), record.show_cmd });
+		}
+	}
+	// An item of a rebuild in record form, for writing it out
+	Record record(U32 item) const {
+		Record r = {};
+		r.name = name(item);
+		if (const Target* t = target(item)) {
+			r.target = str(t->target);
+			r.arguments = str(t->arguments);
+			r.work_dir = str(t->work_dir);
+			r.show_cmd = t->show_cmd;
+		}
+		r.flags = flags[item];
+		r.group = child_groups[item];
+		r.icon = (U32)slots[item];
+		r.label_start = (unsigned short)(labels[item].length ? labels[item].pos - names[item].pos : 0);
+		r.label_length = (unsigned short)labels[item].length;
+		r.stamp = stamps[item];
+		return r;
+	}
+	static Hash entry_hash(StringView name, U64 size, U64 write_time) {
+		CoreUtil::Hasher hasher;
+		hasher.add(name.data(), name.size() * sizeof(Char));
+		hasher.add(&size, sizeof(size));
+		hasher.add(&write_time, sizeof(write_time));
+		return hasher.value();
+	}
+};
+
+
+/**************************************************************************************************
+ * Search over all items of a stack, for type-to-filter. The cache file already holds the normalized
+ * labels as one text, so a query is a substring scan of it with no records decoded.
+ **************************************************************************************************/
+struct SearchIndex {
+	std::vector<U32>    starts;     // search text position of each item's line
+	StringView          text;
+
+	// Needs the cache's index only. Returns false for a search text that doesn't match the items.
+	bool load(const CacheCore& cache) {
+		text = cache.search_text;
+		starts.clear();
+		starts.reserve(cache.item_count());
+		for (size_t pos = 0; pos < text.size(); ) {
+			starts.push_back((U32)pos);
+			size_t end = text.find(L'\n', pos);
+			if (end == StringView::npos) break;
+			pos = end + 1;
+		}
+		return starts.size() == cache.item_count() && (text.empty() || text.back() == L'\n');
+	}
+
+	// Items whose label contains `query`, in scan order, at most `max_results` of them
+	void find(StringView query, size_t max_results, std::vector<U32>& found) const {
+		String q = CacheCore::normalize(query);
+		if (q.empty() || q.find(L'\n') != String::npos) return;
+		size_t pos = text.find(q);
+		while (pos != StringView::npos && found.size() < max_results) {
+			U32 item = (U32)(std::upper_bound(starts.begin(), starts.end(), (U32)pos) - starts.begin() - 1);
+			found.push_back(item);
+			// One result per item: go on from its next line
+			if (item + 1 >= starts.size()) break;
+			pos = text.find(q, starts[item + 1]);
+		}
+	}
+};
+
+
+/**************************************************************************************************
+ * Menu tree: what each menu level shows, independent of how it is drawn
+ **************************************************************************************************/
+struct MenuNode {
+	U32         item;       // index in the CacheCore item table
+	StringView  text;       // display label, owned by the cache
+	bool        is_separator;
+	bool        is_submenu;
+	U32         group;      // cache group with the submenu's children
+};
+
+struct MenuTree {
+
+	// The items of one menu level in menu order: a walk over the group's children, whose records must be decoded.
+	// The root (group 0) leaves out the base folder item.
+	static void build_level(const CacheCore& cache, U32 group, std::vector<MenuNode>& nodes) {
+		const CacheCore::Group& g = cache.groups[group];
+		nodes.reserve(nodes.size() + g.count);
+		for (U32 k = g.first; k < g.first + g.count; ++k) {
+			U32 i = cache.entries[k].item;
+			if (i == 0) continue;
+			bool separator = cache.is_separator(i);
+			nodes.push_back(MenuNode{ i, cache.label(i), separator, cache.is_submenu(i) && !separator, cache.child_groups[i] });
+		}
+	}
+};